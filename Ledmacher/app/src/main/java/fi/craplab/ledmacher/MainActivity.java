@@ -34,6 +34,7 @@ import android.view.animation.AlphaAnimation;
 import android.view.animation.Animation;
 import android.widget.GridLayout;
 import android.widget.TextView;
+import android.widget.Toast;
 
 import com.larswerkman.holocolorpicker.ColorPicker;
 
@@ -163,6 +164,12 @@ public class MainActivity extends AppCompatActivity
             @Override
             public void onColorSelected(final int color) {
                 Log.d(TAG, "color selected: " + String.format("0x%08x", color));
+                int maxColors = getResources().getInteger(R.integer.params_colors_max);
+                if (colorList.size() >= maxColors) {
+                    Toast.makeText(MainActivity.this, getString(R.string.colors_max_reached, maxColors),
+                            Toast.LENGTH_SHORT).show();
+                    return;
+                }
                 if (colorList.isEmpty()) {
                     setState(State.FIRST_COLOR_CONFIG);
                 }
@@ -0,0 +1,175 @@
+/*
+ * Ledmacher Android App
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+package fi.craplab.ledmacher.firmware;
+
+import java.util.Arrays;
+
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+
+/**
+ * Compresses firmware memory pages for a compressed firmware transfer.
+ *
+ * Each memory page is compressed on its own into the LZSS format the bootloader unpacks (see
+ * the format description at the top of the bootloader's main.c). Back references can reach into
+ * all the previous memory pages as well, since the bootloader uses the already flashed firmware
+ * as its dictionary. Pages therefore need to be compressed in the order they are flashed.
+ *
+ * The same format is also implemented in the backend's lzpage.py script.
+ */
+public class PageCompressor {
+    /** Shortest back reference length */
+    private static final int MIN_MATCH = 3;
+    /** Longest back reference length, limited by its 4-bit length field */
+    private static final int MAX_MATCH = MIN_MATCH + 0x0f;
+    /** Farthest back reference offset, limited by its 12-bit offset field */
+    private static final int MAX_OFFSET = 0x1000;
+    /** Maximum number of match candidates to check for each position */
+    private static final int MAX_CHAIN = 256;
+    /** Number of hash table entries to look up match candidates */
+    private static final int HASH_SIZE = 1 << 12;
+
+    /** The whole firmware image */
+    private final byte[] image;
+    /** Most recent image position for each hash value */
+    private final int[] head;
+    /** Previous image position with the same hash value for each image position */
+    private final int[] prev;
+    /** Next image position to add to the hash chains */
+    private int nextPosition;
+
+    /**
+     * Create a new {@code PageCompressor} for the given firmware {@code image}.
+     *
+     * @param image Raw bytes of the firmware
+     */
+    public PageCompressor(@NonNull byte[] image) {
+        this.image = image;
+        head = new int[HASH_SIZE];
+        prev = new int[image.length];
+        Arrays.fill(head, -1);
+    }
+
+    /**
+     * Compress a single memory page.
+     *
+     * @param offset Offset of the memory page within the firmware image
+     * @param length Length of the memory page data
+     * @return Compressed memory page data, or {@code null} if compression doesn't pay off and
+     *         the page should be sent raw instead
+     */
+    @Nullable
+    public byte[] compressPage(int offset, int length) {
+        int end = offset + length;
+        byte[] out = new byte[length + (length + 7) / 8];
+        int outLen = 0;
+        int flagsPos = 0;
+        int item = 8;
+        int pos = offset;
+
+        addPositions(offset);
+
+        while (pos < end) {
+            if (item == 8) {
+                flagsPos = outLen;
+                out[outLen++] = 0;
+                item = 0;
+            }
+
+            int bestLen = 0;
+            int bestOffset = 0;
+            if (pos + MIN_MATCH <= end) {
+                int maxLen = Math.min(MAX_MATCH, end - pos);
+                int candidate = head[hash(pos)];
+                for (int chain = 0; candidate >= 0 && chain < MAX_CHAIN; chain++) {
+                    if (candidate < pos) {
+                        if (pos - candidate > MAX_OFFSET) {
+                            break;
+                        }
+                        int len = 0;
+                        while (len < maxLen && image[candidate + len] == image[pos + len]) {
+                            len++;
+                        }
+                        if (len > bestLen) {
+                            bestLen = len;
+                            bestOffset = pos - candidate;
+                            if (len == maxLen) {
+                                break;
+                            }
+                        }
+                    }
+                    candidate = prev[candidate];
+                }
+            }
+
+            int step;
+            if (bestLen >= MIN_MATCH) {
+                int code = bestOffset - 1;
+                out[outLen++] = (byte) (((code >> 4) & 0xf0) | (bestLen - MIN_MATCH));
+                out[outLen++] = (byte) code;
+                step = bestLen;
+            } else {
+                out[flagsPos] |= (byte) (1 << item);
+                out[outLen++] = image[pos];
+                step = 1;
+            }
+
+            pos += step;
+            addPositions(pos);
+            item++;
+        }
+
+        if (outLen >= length) {
+            return null;
+        }
+        return Arrays.copyOf(out, outLen);
+    }
+
+    /**
+     * Add all image positions up to the given {@code end} to the hash chains.
+     *
+     * @param end Image position to stop at
+     */
+    private void addPositions(int end) {
+        while (nextPosition < end) {
+            if (nextPosition + MIN_MATCH <= image.length) {
+                int h = hash(nextPosition);
+                prev[nextPosition] = head[h];
+                head[h] = nextPosition;
+            }
+            nextPosition++;
+        }
+    }
+
+    /**
+     * Hash the {@value MIN_MATCH} bytes at the given image position.
+     *
+     * @param pos Image position
+     * @return Hash table index
+     */
+    private int hash(int pos) {
+        int value = (image[pos] & 0xff) << 8 ^ (image[pos + 1] & 0xff) << 4 ^ (image[pos + 2] & 0xff);
+        return value & (HASH_SIZE - 1);
+    }
+}
@@ -117,7 +117,7 @@ public class ParameterConfigDialog extends DialogFragment {
             }
         });
 
-        Resources res = getResources();
+        final Resources res = getResources();
 
         final int numLeds = sharedPrefs.getInt(
                 getString(R.string.prefs_key_num_leds),
@@ -147,11 +147,17 @@ public class ParameterConfigDialog extends DialogFragment {
         builder.setPositiveButton("Save", new DialogInterface.OnClickListener() {
             @Override
             public void onClick(DialogInterface dialogInterface, int i) {
+                int waitMax = res.getInteger(R.integer.params_wait_max);
+
                 SharedPreferences.Editor editor = sharedPrefs.edit();
-                editor.putInt(getString(R.string.prefs_key_num_leds), numLedsBar.getProgress());
-                editor.putInt(getString(R.string.prefs_key_wait_color), Integer.parseInt(waitColor.getText().toString()));
-                editor.putInt(getString(R.string.prefs_key_wait_gradient), Integer.parseInt(waitGradient.getText().toString()));
-                editor.putInt(getString(R.string.prefs_key_gradient_steps), Integer.parseInt(gradientSteps.getText().toString()));
+                editor.putInt(getString(R.string.prefs_key_num_leds), Math.max(1, numLedsBar.getProgress()));
+                editor.putInt(getString(R.string.prefs_key_wait_color), getLimitedValue(waitColor, 0, waitMax,
+                        res.getInteger(R.integer.params_wait_color_default)));
+                editor.putInt(getString(R.string.prefs_key_wait_gradient), getLimitedValue(waitGradient, 0, waitMax,
+                        res.getInteger(R.integer.params_wait_gradient_default)));
+                editor.putInt(getString(R.string.prefs_key_gradient_steps), getLimitedValue(gradientSteps, 1,
+                        res.getInteger(R.integer.params_gradient_steps_max),
+                        res.getInteger(R.integer.params_gradient_steps_default)));
                 editor.putBoolean(getString(R.string.prefs_key_reset_after_flash), resetDevice.isChecked());
                 editor.apply();
 
@@ -164,4 +170,27 @@ public class ParameterConfigDialog extends DialogFragment {
         });
         return builder.create();
     }
+
+    /**
+     * Get the number entered in the given text field, limited to the given range.
+     *
+     * The firmware keeps the parameters in fixed-size fields, and the backend rejects any value
+     * that doesn't fit, so they're limited right here already.
+     *
+     * @param text Text field to read the number from
+     * @param min Smallest allowed value
+     * @param max Largest allowed value
+     * @param fallback Value to use if the text field doesn't contain a number
+     * @return Entered number, limited to the given range
+     */
+    private static int getLimitedValue(EditText text, int min, int max, int fallback) {
+        int value;
+
+        try {
+            value = Integer.parseInt(text.getText().toString());
+        } catch (NumberFormatException e) {
+            value = fallback;
+        }
+        return Math.max(min, Math.min(max, value));
+    }
 }
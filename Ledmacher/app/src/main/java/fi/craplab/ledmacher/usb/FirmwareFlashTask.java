@@ -31,6 +31,7 @@ import java.lang.ref.WeakReference;
 import androidx.annotation.NonNull;
 import fi.craplab.ledmacher.MainActivity;
 import fi.craplab.ledmacher.firmware.FirmwareHandler;
+import fi.craplab.ledmacher.firmware.PageCompressor;
 
 /**
  * AsyncTask to flash the binary firmware data to a Ledmacher device connected via USB.
@@ -117,34 +118,62 @@ public class FirmwareFlashTask extends AsyncTask<FirmwareHandler, Integer, Boole
 
         try {
             UsbHandler usbHandler = UsbHandler.getInstance();
-            usbHandler.initiateFirmwareFlash(firmwareHandler.getNumberOfPages());
-
-            double progressPerPage = 100.0 / firmwareHandler.getNumberOfPages();
-            byte[] buffer = new byte[UsbHandler.HEADER_SIZE + UsbHandler.PAGE_SIZE];
+            int numberOfPages = firmwareHandler.getNumberOfPages();
             byte[] firmware = firmwareHandler.getFirmware();
-            int offset = 0;
-
-            for (int pageNumber = 1;
-                 pageNumber <= firmwareHandler.getNumberOfPages(); pageNumber++) {
-                int bytesLeft = firmwareHandler.getTotalSize() - offset;
-                int chunkSize = Math.min(bytesLeft, UsbHandler.PAGE_SIZE);
 
-                buffer[0] = (byte) pageNumber;
-                buffer[1] = (byte) chunkSize;
-                System.arraycopy(firmware, offset, buffer, UsbHandler.HEADER_SIZE, chunkSize);
+            if (!usbHandler.initiateFirmwareFlash(numberOfPages, firmware)) {
+                usbHandler.skipFirmwareFlash();
+                return true;
+            }
 
-                int retryCount = usbHandler.flashFirmwarePage(buffer, chunkSize + UsbHandler.HEADER_SIZE);
-                Log.d("TAG", "transferred page " + pageNumber + " bytes " + offset + "-" +
-                        (offset + chunkSize - 1) + " after " + retryCount + " retries");
-                publishProgress((int) (pageNumber * progressPerPage));
+            double progressPerPage = 100.0 / numberOfPages;
+            byte[][] packedPages = new byte[numberOfPages][];
+            int sentBytes = 0;
+
+            if (usbHandler.supportsCompression()) {
+                PageCompressor compressor = new PageCompressor(firmware);
+                for (int page = 0; page < numberOfPages; page++) {
+                    int offset = page * UsbHandler.PAGE_SIZE;
+                    int chunkSize = Math.min(firmware.length - offset, UsbHandler.PAGE_SIZE);
+                    packedPages[page] = compressor.compressPage(offset, chunkSize);
+                }
+            }
 
-                offset += chunkSize;
+            /*
+             * Send as many consecutive pages at once as the device accepts, as long as they are
+             * all either compressed or raw, since that's decided for the whole transfer.
+             */
+            int page = 0;
+            while (page < numberOfPages) {
+                boolean compressed = (packedPages[page] != null);
+                int pageCount = 1;
+                while (page + pageCount < numberOfPages &&
+                        pageCount < usbHandler.getPagesPerTransfer() &&
+                        (packedPages[page + pageCount] != null) == compressed) {
+                    pageCount++;
+                }
+
+                int retryCount = usbHandler.flashFirmwarePages(firmware, page, pageCount,
+                        compressed ? packedPages : null);
+
+                int offset = page * UsbHandler.PAGE_SIZE;
+                int length = Math.min(pageCount * UsbHandler.PAGE_SIZE, firmware.length - offset);
+                for (int i = page; i < page + pageCount; i++) {
+                    sentBytes += compressed ? packedPages[i].length
+                                            : Math.min(firmware.length - i * UsbHandler.PAGE_SIZE, UsbHandler.PAGE_SIZE);
+                }
+                Log.d("TAG", "transferred pages " + (page + 1) + "-" + (page + pageCount) +
+                        " bytes " + offset + "-" + (offset + length - 1) + " after " +
+                        retryCount + " retries");
+
+                page += pageCount;
+                publishProgress((int) (page * progressPerPage));
             }
 
-            usbHandler.finalizeFirmwareFlash();
+            Log.d("TAG", "sent " + sentBytes + " bytes for " + firmware.length + " bytes of firmware");
+            return usbHandler.finalizeFirmwareFlash(firmware);
         } catch (Exception e) {
             return false;
         }
-        return true;
     }
 }
\ No newline at end of file
@@ -29,6 +29,7 @@ import android.content.Context;
 import android.content.Intent;
 import android.content.IntentFilter;
 import android.content.SharedPreferences;
+import android.hardware.usb.UsbConstants;
 import android.hardware.usb.UsbDevice;
 import android.hardware.usb.UsbDeviceConnection;
 import android.hardware.usb.UsbEndpoint;
@@ -37,7 +38,9 @@ import android.hardware.usb.UsbManager;
 import android.util.Log;
 
 import java.util.ArrayList;
+import java.util.Arrays;
 import java.util.List;
+import java.util.zip.CRC32;
 
 import androidx.annotation.NonNull;
 import fi.craplab.ledmacher.R;
@@ -70,10 +73,73 @@ public class UsbHandler {
      * Chunk transfer header size in bytes.
      * Transferring the firmware to the device is done in chunks if {@value PAGE_SIZE} bytes,
      * along with a header containing information on the memory page number currently transferred,
-     * and the actual size of the data within that chunk. Both are an 8-bit value each, hence the
-     * header size is 2.
+     * and the actual size of the data within that chunk. The page number is a 16-bit value
+     * counted from 0, and the size an 8-bit value, hence the header size is 3.
+     *
+     * Bootloaders before version 1.3 use an 8-bit page number counted from 1 instead, so the
+     * header size is 2 for them. See {@link #getHeaderSize()}.
+     */
+    static final int HEADER_SIZE = 3;
+    /** Chunk transfer header size in bytes for bootloaders before version 1.3 */
+    private static final int HEADER_SIZE_8BIT_PAGES = 2;
+
+    /**
+     * Offset of the application image header within the firmware.
+     * The header is placed right after the interrupt vector table, and contains the firmware's
+     * magic number, length, build hash and CRC32. Bootloaders since version 1.5 append the
+     * installed firmware's header to the HELLO response.
      */
-    static final int HEADER_SIZE = 2;
+    private static final int IMAGE_HEADER_OFFSET = 0x68;
+    /** Application image header size in bytes */
+    private static final int IMAGE_HEADER_SIZE = 18;
+
+    /*
+     * Capability block layout, sent by bootloaders since version 1.8 as part of the HELLO
+     * response. The block starts with its own size, so newer bootloaders can extend it.
+     */
+    /** Offset of the memory page size within the capability block */
+    private static final int CAPS_PAGE_SIZE     = 3;
+    /** Offset of the application section size within the capability block */
+    private static final int CAPS_APP_SIZE      = 5;
+    /** Offset of the maximum transfer size within the capability block */
+    private static final int CAPS_MAX_TRANSFER  = 7;
+    /** Offset of the feature flags within the capability block */
+    private static final int CAPS_FEATURES      = 11;
+    /** Minimum size of a valid capability block */
+    private static final int CAPS_MIN_SIZE      = 12;
+    /** Offset of the memory page transfer protocol revision, since bootloader version 1.12 */
+    private static final int CAPS_PROTOCOL      = 13;
+    /** Offset of the maximum number of chunks in a window, since bootloader version 1.12 */
+    private static final int CAPS_WINDOW_SIZE   = 14;
+
+    /** Protocol revision sending memory pages in windows, see {@link #flashFirmwareWindow} */
+    private static final int PROTOCOL_WINDOW    = 2;
+    /** Maximum number of chunks in a window, one bit each in the ACK response */
+    private static final int MAX_WINDOW_SIZE    = 16;
+    /** Size of the sequence number in front of each chunk in a window */
+    private static final int WINDOW_SEQ_SIZE    = 1;
+    /** Size of the CRC16 at the end of each chunk in a window */
+    private static final int WINDOW_CRC_SIZE    = 2;
+    /** Size of the ACK response, containing the window number and the acknowledged chunks */
+    private static final int WINDOW_ACK_SIZE    = 4;
+
+    /** Feature flag for compressed memory page support */
+    private static final int FEATURE_COMPRESSION    = 0x01;
+    /** Feature flag for multiple memory pages per transfer support */
+    private static final int FEATURE_MULTI_PAGE     = 0x02;
+    /** Feature flag for CRC32 validation support */
+    private static final int FEATURE_CRC            = 0x04;
+    /** Feature flag for background page erase support */
+    private static final int FEATURE_ERASE_AHEAD    = 0x40;
+    /** Feature flag for flashing notifications on the interrupt-IN endpoint */
+    private static final int FEATURE_NOTIFY         = 0x80;
+
+    /** Size of a single notification received on the interrupt-IN endpoint */
+    private static final int NOTIFY_SIZE        = 8;
+    /** Notification that a memory page couldn't be written */
+    private static final int NOTIFY_ERROR       = 0x02;
+    /** Notification that all memory pages of a transfer are written, along with their CRC32 */
+    private static final int NOTIFY_READY       = 0x03;
 
     /** USB control transfer timeout in milliseconds */
     private static final int USB_TIMEOUT_MS = 2000;
@@ -92,11 +158,28 @@ public class UsbHandler {
     private static final int CMD_FWUPDATE_VERIFY    = 0x12;
     /** Finalize a firmware updating process */
     private static final int CMD_FWUPDATE_FINALIZE  = 0x13;
+    /** Retrieve the CRC32 of the flashed application firmware */
+    private static final int CMD_FWUPDATE_CRC       = 0x14;
+    /** Erase a range of memory pages in the background ahead of sending them */
+    private static final int CMD_FWUPDATE_ERASE     = 0x16;
+    /** Retrieve the chunks of the current window the device has written */
+    private static final int CMD_FWUPDATE_ACK       = 0x18;
     /** Gracefully say good bye to the device */
     private static final int CMD_BYE                = 0xf0;
     /** Reset the device */
     private static final int CMD_RESET              = 0xfa;
 
+    /** Memory page transfer value parameter for raw memory page data */
+    private static final int MEMPAGE_RAW        = 0;
+    /** Memory page transfer value parameter for compressed memory page data */
+    private static final int MEMPAGE_COMPRESSED = 1;
+    /** Memory page transfer value parameter flag for chunks sent in a window */
+    private static final int MEMPAGE_WINDOW     = 2;
+    /** Maximum number of memory pages sent in a single transfer */
+    private static final int PAGES_PER_TRANSFER = 8;
+    /** Number of attempts to flash compressed memory pages before falling back to raw data */
+    private static final int COMPRESSED_ATTEMPTS = 3;
+
     /** USB control request value parameter expected by the bootloader for the HELLO command */
     private static final int HELLO_VALUE = 0x4d6f;
     /** USB control request index parameter expected by the bootloader for the HELLO command */
@@ -111,6 +194,16 @@ public class UsbHandler {
     private final Context context;
     private final UsbManager usbManager;
     private UsbDeviceConnection bootloaderConnection;
+    /** Interrupt-IN endpoint the bootloader posts flashing notifications on, if any */
+    private UsbEndpoint notifyEndpoint;
+    /** Banner string received from the bootloader in the last HELLO command */
+    private String bootloaderBanner = "";
+    /** Installed application's image header received in the last HELLO command, if any */
+    private byte[] installedImageHeader;
+    /** Capability block received from the bootloader in the last HELLO command, if any */
+    private byte[] bootloaderCapabilities;
+    /** Number of the next window to send, restarting from 0 with each firmware update */
+    private int nextWindow;
     private List<Listener> listeners;
     private PendingIntent permissionIntent;
 
@@ -472,22 +565,26 @@ public class UsbHandler {
      */
     private boolean openDeviceConnection(UsbDevice device) {
         bootloaderConnection = null;
+        notifyEndpoint = null;
 
         if (device.getInterfaceCount() == 0) {
             Log.e(TAG, "Don't have interfaces");
             return false;
         }
 
+        // The lean bootloader build has no interrupt endpoint at all, everything then goes
+        // through the control endpoint and pages are verified by reading them back.
         UsbInterface usbInterface = device.getInterface(0);
-        if (usbInterface.getEndpointCount() == 0) {
-            Log.e(TAG, "Don't have endpoints on interface " + usbInterface);
-            return false;
+        UsbEndpoint endpoint = null;
+        if (usbInterface.getEndpointCount() > 0) {
+            endpoint = usbInterface.getEndpoint(0);
+            Log.i(TAG, "Opened endpoint " + endpoint.getEndpointNumber() + " of interface " +
+                    usbInterface.getId());
+        } else {
+            Log.i(TAG, "No endpoints on interface " + usbInterface.getId() +
+                    ", using control transfers only");
         }
 
-        UsbEndpoint endpoint = usbInterface.getEndpoint(0);
-        Log.i(TAG, "Opened endpoint " + endpoint.getEndpointNumber() + " of interface " +
-                usbInterface.getId());
-
         UsbDeviceConnection connection = usbManager.openDevice(device);
         if (connection == null) {
             Log.e(TAG, "Cannot open device connection");
@@ -495,6 +592,10 @@ public class UsbHandler {
         }
         connection.claimInterface(usbInterface, true);
 
+        if (endpoint != null && endpoint.getType() == UsbConstants.USB_ENDPOINT_XFER_INT &&
+                endpoint.getDirection() == UsbConstants.USB_DIR_IN) {
+            notifyEndpoint = endpoint;
+        }
         bootloaderConnection = connection;
         return true;
     }
@@ -546,6 +647,10 @@ public class UsbHandler {
      * of this, so it makes sure that there is a valid connection to the right USB device
      * established in the first place.
      *
+     * Since version 1.8, the banner string's trailing \0 is followed by the bootloader's
+     * capability block. If the device has a valid application installed, the bootloader sends
+     * its image header after that, see {@link #isFirmwareInstalled(byte[])}.
+     *
      * @return Bootloader banner string containing its name and version
      * @throws IllegalStateException if there's no connection to a valid device
      */
@@ -555,44 +660,237 @@ public class UsbHandler {
 
         byte[] buffer = new byte[PAGE_SIZE];
         int ret = bootloaderConnection.controlTransfer(USB_RECV, CMD_HELLO, HELLO_VALUE, HELLO_INDEX, buffer, buffer.length, USB_TIMEOUT_MS);
-        // Bootloader version string contains trailing \0, remove it here and return received buffer data as string
-        return new String(buffer, 0, ret - 1);
+
+        // Bootloader version string contains trailing \0, split it from the data following it
+        int bannerLength = 0;
+        while (bannerLength < ret && buffer[bannerLength] != 0) {
+            bannerLength++;
+        }
+        bootloaderBanner = new String(buffer, 0, bannerLength);
+
+        int offset = bannerLength + 1;
+        bootloaderCapabilities = null;
+        if (isBootloaderVersionAtLeast(1, 8) && offset < ret) {
+            int capsSize = buffer[offset] & 0xff;
+            if (capsSize >= CAPS_MIN_SIZE && offset + capsSize <= ret) {
+                bootloaderCapabilities = Arrays.copyOfRange(buffer, offset, offset + capsSize);
+                offset += capsSize;
+            }
+        }
+
+        installedImageHeader = (ret - offset == IMAGE_HEADER_SIZE)
+                ? Arrays.copyOfRange(buffer, offset, ret)
+                : null;
+        return bootloaderBanner;
+    }
+
+    /**
+     * Check if the given firmware is already installed on the device.
+     *
+     * Compares the firmware's image header with the one the bootloader reported in the last
+     * HELLO command. As the header contains the build hash, length and CRC32 of the firmware,
+     * a match means the device already runs the very same build.
+     *
+     * @param firmware Raw bytes of the whole firmware
+     * @return {@code true} if the firmware is already installed, {@code false} otherwise or if
+     *         the bootloader didn't report any installed firmware
+     */
+    private boolean isFirmwareInstalled(byte[] firmware) {
+        if (installedImageHeader == null || firmware.length < IMAGE_HEADER_OFFSET + IMAGE_HEADER_SIZE) {
+            return false;
+        }
+
+        byte[] header = Arrays.copyOfRange(firmware, IMAGE_HEADER_OFFSET, IMAGE_HEADER_OFFSET + IMAGE_HEADER_SIZE);
+        return Arrays.equals(header, installedImageHeader);
+    }
+
+    /**
+     * Check if the bootloader version is at least the given {@code major}.{@code minor} version.
+     *
+     * The version is taken from the banner string received in the last HELLO command.
+     *
+     * @param major Required major version
+     * @param minor Required minor version
+     * @return {@code true} if the bootloader has at least the given version, {@code false} if
+     *         it's older or the version is unknown
+     */
+    private boolean isBootloaderVersionAtLeast(int major, int minor) {
+        if (!bootloaderBanner.startsWith(BOOTLOADER_BANNER_PREFIX)) {
+            return false;
+        }
+
+        String[] version = bootloaderBanner.substring(BOOTLOADER_BANNER_PREFIX.length()).split("\\.");
+        try {
+            int bootloaderMajor = Integer.parseInt(version[0]);
+            int bootloaderMinor = (version.length > 1) ? Integer.parseInt(version[1]) : 0;
+            return bootloaderMajor > major || (bootloaderMajor == major && bootloaderMinor >= minor);
+        } catch (NumberFormatException e) {
+            return false;
+        }
+    }
+
+    /**
+     * Get a 16-bit little endian value from the bootloader's capability block.
+     *
+     * @param offset Offset of the value within the capability block
+     * @return Value at the given offset
+     */
+    private int getCapability(int offset) {
+        return (bootloaderCapabilities[offset] & 0xff) | ((bootloaderCapabilities[offset + 1] & 0xff) << 8);
+    }
+
+    /**
+     * Check if the bootloader supports the given feature.
+     *
+     * If the bootloader sent a capability block, the feature flags in there are used, otherwise
+     * the bootloader version tells if the feature is supported. This requires that a HELLO
+     * command was sent before, which {@link #initiateFirmwareFlash(int, byte[])} takes care of.
+     *
+     * @param feature Feature flag, one of the {@code FEATURE_*} values
+     * @param major Bootloader major version that added the feature
+     * @param minor Bootloader minor version that added the feature
+     * @return {@code true} if the feature is supported, {@code false} otherwise
+     */
+    private boolean hasFeature(int feature, int major, int minor) {
+        if (bootloaderCapabilities != null) {
+            return (bootloaderCapabilities[CAPS_FEATURES] & feature) != 0;
+        }
+        return isBootloaderVersionAtLeast(major, minor);
+    }
+
+    /**
+     * Check if the bootloader can unpack compressed memory pages.
+     *
+     * Compressed memory pages are supported since bootloader version 1.1.
+     *
+     * @return {@code true} if compressed memory pages can be sent, {@code false} otherwise
+     */
+    boolean supportsCompression() {
+        return hasFeature(FEATURE_COMPRESSION, 1, 1);
+    }
+
+    /**
+     * Check if the bootloader validates the firmware with a CRC32.
+     *
+     * Bootloader versions since 1.4 calculate the CRC32 of the flashed firmware when the update
+     * is finalized, and refuse to start an application that wasn't finalized with a matching
+     * CRC32.
+     *
+     * @return {@code true} if the bootloader supports CRC32 validation, {@code false} otherwise
+     */
+    private boolean supportsCrc() {
+        return hasFeature(FEATURE_CRC, 1, 4);
+    }
+
+    /**
+     * Check if the bootloader posts flashing notifications on its interrupt-IN endpoint.
+     *
+     * Bootloader versions since 1.10 notify about each written memory page, and send the CRC32
+     * of all memory pages written in a transfer once they're done, so there's no need to read
+     * the memory pages back to verify them. Lean bootloader builds come without interrupt-IN
+     * endpoint, and are always verified by reading back.
+     *
+     * @return {@code true} if notifications can be received, {@code false} otherwise
+     */
+    private boolean supportsNotifications() {
+        return notifyEndpoint != null && hasFeature(FEATURE_NOTIFY, 1, 10);
+    }
+
+    /**
+     * Check if the bootloader accepts memory pages sent in windows.
+     *
+     * Bootloaders with protocol revision {@value PROTOCOL_WINDOW}, i.e. since version 1.12,
+     * acknowledge each chunk of a window on its own, so only the ones with errors need to be
+     * sent again, and there's no need to wait for each transfer to be verified. Compressed
+     * chunks are only acknowledged up to the first one with errors though, as they may refer
+     * back into it.
+     *
+     * @return {@code true} if memory pages can be sent in windows, {@code false} otherwise
+     */
+    private boolean supportsWindows() {
+        return bootloaderCapabilities != null && bootloaderCapabilities.length > CAPS_WINDOW_SIZE &&
+                (bootloaderCapabilities[CAPS_PROTOCOL] & 0xff) >= PROTOCOL_WINDOW &&
+                bootloaderCapabilities[CAPS_WINDOW_SIZE] != 0;
     }
 
     /**
      * Performs firmware update initialization command request.
      *
-     * The initialization part contains the number of memory pages to expect.
+     * The initialization part contains the number of memory pages to expect, and the firmware
+     * size in bytes for bootloaders supporting CRC32 validation.
      *
      * @param numberOfPages Number of memory pages the upcoming firmware is going to have
+     * @param firmwareSize Size of the upcoming firmware in bytes
      * @throws IllegalStateException if there's no connection to a valid device
      * @see FirmwareHandler#getNumberOfPages()
      */
-    private void sendInit(int numberOfPages) {
+    private void sendInit(int numberOfPages, int firmwareSize) {
+        enforceValidConnection();
+        int index = supportsCrc() ? firmwareSize : 0;
+        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_INIT, numberOfPages, index, null, 0, USB_TIMEOUT_MS);
+    }
+
+    /**
+     * Performs firmware update erase command request.
+     *
+     * Tells the device to erase the given range of memory pages in the background, so writing
+     * them later on doesn't have to wait for each page to be erased first.
+     *
+     * @param firstPage First memory page to erase
+     * @param numberOfPages Number of memory pages to erase
+     * @throws IllegalStateException if there's no connection to a valid device
+     */
+    private void sendErase(int firstPage, int numberOfPages) {
         enforceValidConnection();
-        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_INIT, numberOfPages, 0, null, 0, USB_TIMEOUT_MS);
+        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_ERASE, firstPage, numberOfPages, null, 0, USB_TIMEOUT_MS);
     }
 
     /**
      * Performs firmware mempage transfer command request.
      *
-     * Sends a {@value PAGE_SIZE} byte chunk of firmware data to the device for it to flash as its
-     * new application firmware.
+     * Sends one or more {@value PAGE_SIZE} byte chunks of firmware data to the device for it to
+     * flash as its new application firmware.
      *
      * @param data Raw bytes of firmware
      * @param len Length of data sent to the device
+     * @param mode {@link #MEMPAGE_RAW} or {@link #MEMPAGE_COMPRESSED} for compressed page data,
+     *             combined with {@link #MEMPAGE_WINDOW} for chunks sent in a window
+     * @param window Window number for chunks sent in a window, ignored otherwise
      * @throws IllegalStateException if there's no connection to a valid device
      */
-    private void sendMemPage(byte[] data, int len) {
+    private void sendMemPage(byte[] data, int len, int mode, int window) {
         enforceValidConnection();
-        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_MEMPAGE, 0, 0, data, len, USB_TIMEOUT_MS);
+        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_MEMPAGE, mode, window, data, len, USB_TIMEOUT_MS);
+    }
+
+    /**
+     * Performs firmware window acknowledge command request.
+     *
+     * The device sends back the number of its current window along with a bitmap of the chunks
+     * in it that were received intact and written, bit n standing for sequence number n.
+     *
+     * @param window Window number the chunks were sent in
+     * @return Bitmap of the acknowledged chunks, or {@code 0} if the request failed or the
+     *         device is at a different window
+     * @throws IllegalStateException if there's no connection to a valid device
+     */
+    private int sendAck(int window) {
+        enforceValidConnection();
+
+        byte[] buffer = new byte[WINDOW_ACK_SIZE];
+        int ret = bootloaderConnection.controlTransfer(USB_RECV, CMD_FWUPDATE_ACK, 0, 0, buffer, buffer.length, USB_TIMEOUT_MS);
+        if (ret != buffer.length || ((buffer[0] & 0xff) | ((buffer[1] & 0xff) << 8)) != window) {
+            return 0;
+        }
+
+        return (buffer[2] & 0xff) | ((buffer[3] & 0xff) << 8);
     }
 
     /**
      * Performs firmware mempage validation command request.
      *
-     * The device will send back the last received chunk of firmware so we can compare if sending
-     * the chunk actually succeeded.
+     * The device will send back the chunks of firmware received in the last transfer so we can
+     * compare if sending the chunks actually succeeded.
      *
      * @param buffer Receive buffer for the firmware chunk sent back by the device
      * @param bufferLen Length of the received data
@@ -606,13 +904,79 @@ public class UsbHandler {
     /**
      * Performs firmware update finalization command request.
      *
-     * Finishes up the firmware update on the device side.
+     * Finishes up the firmware update on the device side. The expected CRC32 of the firmware is
+     * passed along, lower 16 bits as value and upper 16 bits as index. The device will only
+     * mark the firmware as valid if it matches. Older bootloaders just ignore it.
      *
+     * @param crc Expected CRC32 of the firmware
      * @throws IllegalStateException if there's no connection to a valid device
      */
-    private void sendFinalize() {
+    private void sendFinalize(long crc) {
         enforceValidConnection();
-        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_FINALIZE, 0, 0, null, 0, USB_TIMEOUT_MS);
+        bootloaderConnection.controlTransfer(USB_SEND, CMD_FWUPDATE_FINALIZE,
+                (int) (crc & 0xffff), (int) ((crc >> 16) & 0xffff), null, 0, USB_TIMEOUT_MS);
+    }
+
+    /**
+     * Wait for the bootloader to finish writing the memory pages of the last transfer.
+     *
+     * Reads the notifications from the interrupt-IN endpoint until the one telling that all
+     * memory pages of the transfer are written arrives. Notifications left over from earlier
+     * transfers are skipped based on the last memory page they refer to.
+     *
+     * @param lastPage Last memory page sent in the transfer
+     * @return CRC32 of the written memory pages, or {@code -1} if any of them couldn't be
+     *         written or no notification arrived in time
+     * @throws IllegalStateException if there's no connection to a valid device
+     */
+    private long waitForReady(int lastPage) {
+        enforceValidConnection();
+
+        byte[] buffer = new byte[NOTIFY_SIZE];
+        boolean failed = false;
+
+        while (true) {
+            int ret = bootloaderConnection.bulkTransfer(notifyEndpoint, buffer, buffer.length, USB_TIMEOUT_MS);
+            if (ret != buffer.length) {
+                Log.w(TAG, "No notification received");
+                return -1;
+            }
+
+            int page = (buffer[2] & 0xff) | ((buffer[3] & 0xff) << 8);
+            if (buffer[0] == NOTIFY_ERROR) {
+                Log.w(TAG, "Page " + page + " failed with status " + buffer[1]);
+                failed = true;
+            } else if (buffer[0] == NOTIFY_READY && (failed || page == lastPage)) {
+                if (failed) {
+                    return -1;
+                }
+                return (buffer[4] & 0xffL) | ((buffer[5] & 0xffL) << 8) |
+                        ((buffer[6] & 0xffL) << 16) | ((buffer[7] & 0xffL) << 24);
+            }
+        }
+    }
+
+    /**
+     * Performs firmware CRC32 command request.
+     *
+     * The device calculates the CRC32 over the given amount of bytes of its application
+     * firmware and sends it back in little endian byte order.
+     *
+     * @param length Number of firmware bytes to include in the CRC32
+     * @return CRC32 of the device's application firmware, or {@code -1} if the request failed
+     * @throws IllegalStateException if there's no connection to a valid device
+     */
+    private long sendCrc(int length) {
+        enforceValidConnection();
+
+        byte[] buffer = new byte[4];
+        int ret = bootloaderConnection.controlTransfer(USB_RECV, CMD_FWUPDATE_CRC, length, 0, buffer, buffer.length, USB_TIMEOUT_MS);
+        if (ret != buffer.length) {
+            return -1;
+        }
+
+        return (buffer[0] & 0xffL) | ((buffer[1] & 0xffL) << 8) |
+                ((buffer[2] & 0xffL) << 16) | ((buffer[3] & 0xffL) << 24);
     }
 
     /**
@@ -647,65 +1011,347 @@ public class UsbHandler {
      *
      * This is called from within the {@link FirmwareFlashTask}.
      *
+     * If the device already runs the given firmware, there's no need to flash it again, and
+     * the firmware update isn't initialized on the device at all.
+     *
      * @param numberOfPagesToCome Number of memory pages the firmware is going to have
+     * @param firmware Raw bytes of the whole firmware
+     * @return {@code true} if the firmware update was initialized, {@code false} if the firmware
+     *         is already installed and flashing can be skipped
      */
-    void initiateFirmwareFlash(int numberOfPagesToCome) {
-        Log.d(TAG, "Initiating firmware transfer of " + numberOfPagesToCome + " pages");
+    boolean initiateFirmwareFlash(int numberOfPagesToCome, byte[] firmware) {
         sendHello();
-        sendInit(numberOfPagesToCome);
+
+        if (isFirmwareInstalled(firmware)) {
+            Log.d(TAG, "Firmware already installed, skipping transfer");
+            return false;
+        }
+
+        if (bootloaderCapabilities != null) {
+            if (getCapability(CAPS_PAGE_SIZE) != PAGE_SIZE) {
+                throw new IllegalStateException("Unsupported page size " + getCapability(CAPS_PAGE_SIZE));
+            }
+            if (firmware.length > getCapability(CAPS_APP_SIZE)) {
+                throw new IllegalStateException("Firmware too big for the device");
+            }
+        }
+
+        Log.d(TAG, "Initiating firmware transfer of " + numberOfPagesToCome + " pages");
+        sendInit(numberOfPagesToCome, firmware.length);
+        nextWindow = 0;
+        if (hasFeature(FEATURE_ERASE_AHEAD, 1, 9)) {
+            sendErase(0, numberOfPagesToCome);
+        }
+        return true;
     }
 
     /**
-     * Flash a single memory page.
+     * Get the number of memory pages to send in a single transfer.
+     *
+     * Bootloader versions since 1.2 accept any number of memory pages in one transfer, older
+     * ones only a single page. If the bootloader sent a capability block, the number of pages
+     * is also limited by the maximum transfer size it supports. If the bootloader accepts
+     * windows, a whole window is sent at once.
+     *
+     * @return Maximum number of memory pages to send at once
+     */
+    int getPagesPerTransfer() {
+        if (!hasFeature(FEATURE_MULTI_PAGE, 1, 2)) {
+            return 1;
+        }
+        if (bootloaderCapabilities != null) {
+            if (supportsWindows()) {
+                int windowSize = Math.min(MAX_WINDOW_SIZE, bootloaderCapabilities[CAPS_WINDOW_SIZE] & 0xff);
+                int maxPages = getCapability(CAPS_MAX_TRANSFER) /
+                        (WINDOW_SEQ_SIZE + HEADER_SIZE + PAGE_SIZE + WINDOW_CRC_SIZE);
+                return Math.max(1, Math.min(windowSize, maxPages));
+            }
+            int maxPages = getCapability(CAPS_MAX_TRANSFER) / (HEADER_SIZE + PAGE_SIZE);
+            return Math.max(1, Math.min(PAGES_PER_TRANSFER, maxPages));
+        }
+        return PAGES_PER_TRANSFER;
+    }
+
+    /**
+     * Get the chunk transfer header size used by the connected bootloader.
+     *
+     * This requires that a HELLO command was sent before.
+     *
+     * @return Chunk transfer header size in bytes
+     * @see #HEADER_SIZE
+     */
+    private int getHeaderSize() {
+        return isBootloaderVersionAtLeast(1, 3) ? HEADER_SIZE : HEADER_SIZE_8BIT_PAGES;
+    }
+
+    /**
+     * Flash a series of consecutive memory pages.
      *
      * This is called from within the {@link FirmwareFlashTask}.
      *
-     * The memory page is both written and read back to verify that the content matches and
-     * everything went well during the transfer. If the content doesn't match, the memory page
-     * is sent again for all eternity until it does match. The amount of actual attempts is
-     * in the end returned then.
+     * All memory pages are sent within a single transfer, with a chunk header in front of each
+     * page's data, and then read back to verify that the content matches and everything went
+     * well during the transfer. If the content doesn't match, the memory pages are sent again
+     * for all eternity until it does match. The amount of actual attempts is in the end returned
+     * then.
      *
      * While the content mismatch should be more of an exception in an ideal world, it happens
      * actually quite regularly, and like multiple times within one firmware update process.
      * Whether that's a drawback of the V-USB library used on the device, or a flaw in the
      * communication implementation otherwise remains to be seen.
      *
-     * @param pageData Raw bytes of memory page data
-     * @param pageSize Size of the data in this page
+     * If {@code packedPages} are given, the compressed data is sent instead of the raw data, and
+     * the raw data is used to verify what the device has unpacked. If the compressed pages can't
+     * be verified after a few attempts, the raw data is sent instead.
+     *
+     * @param firmware Raw bytes of the whole firmware
+     * @param firstPage Index of the first memory page to flash, starting from 0
+     * @param pageCount Number of memory pages to flash
+     * @param packedPages Compressed data of each memory page in the firmware, or {@code null} to
+     *                    send the raw memory page data
      * @return Number of retries it took to have the correct data flashed.
      */
-    int flashFirmwarePage(byte[] pageData, int pageSize) {
+    int flashFirmwarePages(byte[] firmware, int firstPage, int pageCount, byte[][] packedPages) {
+        if (supportsWindows()) {
+            return flashFirmwareWindow(firmware, firstPage, pageCount, packedPages);
+        }
+
+        int offset = firstPage * PAGE_SIZE;
+        int length = Math.min(pageCount * PAGE_SIZE, firmware.length - offset);
+        byte[] transferData = new byte[pageCount * (HEADER_SIZE + PAGE_SIZE)];
+        int transferSize = 0;
+
+        for (int page = firstPage; page < firstPage + pageCount; page++) {
+            int pageOffset = page * PAGE_SIZE;
+            int chunkSize = Math.min(PAGE_SIZE, firmware.length - pageOffset);
+            byte[] chunkData = firmware;
+
+            if (packedPages != null) {
+                chunkData = packedPages[page];
+                chunkSize = chunkData.length;
+                pageOffset = 0;
+            }
+
+            if (getHeaderSize() == HEADER_SIZE) {
+                transferData[transferSize++] = (byte) page;
+                transferData[transferSize++] = (byte) (page >> 8);
+            } else {
+                transferData[transferSize++] = (byte) (page + 1);
+            }
+            transferData[transferSize++] = (byte) chunkSize;
+            System.arraycopy(chunkData, pageOffset, transferData, transferSize, chunkSize);
+            transferSize += chunkSize;
+        }
+
+        if (packedPages != null) {
+            for (int attempt = 1; attempt <= COMPRESSED_ATTEMPTS; attempt++) {
+                if (transferPages(transferData, transferSize, MEMPAGE_COMPRESSED, firmware, offset, length)) {
+                    return attempt;
+                }
+            }
+
+            Log.w(TAG, "Compressed memory pages failed, sending them raw");
+            return COMPRESSED_ATTEMPTS + flashFirmwarePages(firmware, firstPage, pageCount, null);
+        }
+
         int retryCount = 0;
         boolean verified = false;
 
-        byte[] verifyData = new byte[PAGE_SIZE];
         while (!verified) {
-            sendMemPage(pageData, pageSize);
-            sendVerify(verifyData, verifyData.length);
-
-            verified = true;
-            for (int i = 0; i < pageSize - HEADER_SIZE; i++) {
-                if (pageData[HEADER_SIZE + i] != verifyData[i]) {
-                    verified = false;
-                    break;
-                }
-            }
+            verified = transferPages(transferData, transferSize, MEMPAGE_RAW, firmware, offset, length);
             retryCount++;
         }
 
         return retryCount;
     }
 
+    /**
+     * Flash a series of consecutive memory pages as one window.
+     *
+     * Each memory page is sent as chunk with its sequence number within the window in front, and
+     * the CRC16 of the whole chunk at the end. The device only writes the chunks that arrive
+     * intact, and tells which ones it wrote when asked for the window's acknowledgement. All
+     * the others are sent again in the same window, for all eternity until every chunk is
+     * written, just like {@link #flashFirmwarePages} does. For compressed chunks, that's all
+     * the ones from the first broken one on, as the device won't write any chunk before the
+     * ones in front of it, which it may refer back into.
+     *
+     * If {@code packedPages} are given and they can't all be written after a few attempts, the
+     * whole window is sent again as raw data in a new window.
+     *
+     * @param firmware Raw bytes of the whole firmware
+     * @param firstPage Index of the first memory page to flash, starting from 0
+     * @param pageCount Number of memory pages to flash, at most the window size
+     * @param packedPages Compressed data of each memory page in the firmware, or {@code null} to
+     *                    send the raw memory page data
+     * @return Number of retries it took to have the correct data flashed.
+     */
+    private int flashFirmwareWindow(byte[] firmware, int firstPage, int pageCount, byte[][] packedPages) {
+        byte[][] chunks = new byte[pageCount][];
+        int mode = MEMPAGE_WINDOW | ((packedPages != null) ? MEMPAGE_COMPRESSED : MEMPAGE_RAW);
+        int window = nextWindow++ & 0xffff;
+
+        for (int seq = 0; seq < pageCount; seq++) {
+            int page = firstPage + seq;
+            int pageOffset = page * PAGE_SIZE;
+            int chunkSize = Math.min(PAGE_SIZE, firmware.length - pageOffset);
+            byte[] chunkData = firmware;
+
+            if (packedPages != null) {
+                chunkData = packedPages[page];
+                chunkSize = chunkData.length;
+                pageOffset = 0;
+            }
+
+            byte[] chunk = new byte[WINDOW_SEQ_SIZE + HEADER_SIZE + chunkSize + WINDOW_CRC_SIZE];
+            chunk[0] = (byte) seq;
+            chunk[1] = (byte) page;
+            chunk[2] = (byte) (page >> 8);
+            chunk[3] = (byte) chunkSize;
+            System.arraycopy(chunkData, pageOffset, chunk, WINDOW_SEQ_SIZE + HEADER_SIZE, chunkSize);
+
+            int crc = crc16(chunk, chunk.length - WINDOW_CRC_SIZE);
+            chunk[chunk.length - 2] = (byte) (crc >> 8);
+            chunk[chunk.length - 1] = (byte) crc;
+            chunks[seq] = chunk;
+        }
+
+        int pending = (1 << pageCount) - 1;
+        int attempt = 0;
+
+        while (pending != 0) {
+            attempt++;
+            if (packedPages != null && attempt > COMPRESSED_ATTEMPTS) {
+                Log.w(TAG, "Compressed memory pages failed, sending them raw");
+                return COMPRESSED_ATTEMPTS + flashFirmwareWindow(firmware, firstPage, pageCount, null);
+            }
+
+            byte[] transferData = new byte[pageCount * (WINDOW_SEQ_SIZE + HEADER_SIZE + PAGE_SIZE + WINDOW_CRC_SIZE)];
+            int transferSize = 0;
+            for (int seq = 0; seq < pageCount; seq++) {
+                if ((pending & (1 << seq)) != 0) {
+                    System.arraycopy(chunks[seq], 0, transferData, transferSize, chunks[seq].length);
+                    transferSize += chunks[seq].length;
+                }
+            }
+
+            sendMemPage(transferData, transferSize, mode, window);
+            pending &= ~sendAck(window);
+        }
+
+        return attempt;
+    }
+
+    /**
+     * Calculate the CRC16 of a chunk sent in a window.
+     *
+     * Uses the XMODEM variant (polynomial 0x1021, initial value 0) the bootloader gets from
+     * avr-libc. Sent in big endian byte order, the CRC16 over the whole chunk is zero then.
+     *
+     * @param data Chunk data, starting with the sequence number
+     * @param length Number of bytes to include
+     * @return CRC16 of the given data
+     */
+    private static int crc16(byte[] data, int length) {
+        int crc = 0;
+
+        for (int i = 0; i < length; i++) {
+            crc ^= (data[i] & 0xff) << 8;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = ((crc & 0x8000) != 0) ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc & 0xffff;
+    }
+
+    /**
+     * Send a series of memory pages and read them back to verify them.
+     *
+     * If the bootloader supports notifications, the memory pages aren't read back, but only the
+     * CRC32 it reports for them is compared with the firmware's.
+     *
+     * @param sendData Memory page chunks to send, including their chunk headers
+     * @param sendSize Size of the data to send
+     * @param mode {@link #MEMPAGE_RAW} or {@link #MEMPAGE_COMPRESSED} for compressed page data
+     * @param firmware Raw bytes of the whole firmware
+     * @param offset Offset of the first sent memory page within the firmware
+     * @param length Length of the raw memory page data expected to be flashed
+     * @return {@code true} if the flashed memory pages match, {@code false} otherwise
+     */
+    private boolean transferPages(byte[] sendData, int sendSize, int mode, byte[] firmware,
+            int offset, int length) {
+        sendMemPage(sendData, sendSize, mode, 0);
+
+        if (supportsNotifications()) {
+            CRC32 crc = new CRC32();
+            crc.update(firmware, offset, length);
+            return waitForReady((offset + length - 1) / PAGE_SIZE) == crc.getValue();
+        }
+
+        byte[] verifyData = new byte[length];
+        sendVerify(verifyData, verifyData.length);
+
+        for (int i = 0; i < length; i++) {
+            if (firmware[offset + i] != verifyData[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     /**
      * Finalizes a firmware update process.
      *
      * Based on the reset setting in the {@link SharedPreferences} a reset might be triggered
      * right away as well, booting straight into the freshly flashed application firmware.
      *
+     * If the bootloader supports it, the CRC32 of the whole flashed firmware is requested from
+     * the device and compared against the firmware we sent. In case of a mismatch, the device
+     * won't start the application, and neither BYE nor reset is sent, so the update can be
+     * simply started again.
+     *
      * This is called from within the {@link FirmwareFlashTask}.
+     *
+     * @param firmware Raw bytes of the whole firmware
+     * @return {@code true} if the firmware was finalized successfully, {@code false} if the
+     *         CRC32 of the flashed firmware doesn't match
+     */
+    boolean finalizeFirmwareFlash(byte[] firmware) {
+        CRC32 crc = new CRC32();
+        crc.update(firmware);
+        long expectedCrc = crc.getValue();
+
+        sendFinalize(expectedCrc);
+
+        if (supportsCrc()) {
+            long deviceCrc = sendCrc(firmware.length);
+            Log.d(TAG, String.format("CRC32 expected %08x, device %08x", expectedCrc, deviceCrc));
+            if (deviceCrc != expectedCrc) {
+                return false;
+            }
+        }
+
+        closeFirmwareFlash();
+        return true;
+    }
+
+    /**
+     * Skips a firmware update process for a firmware that is already installed.
+     *
+     * The device is left the same way as after an actual firmware update, so it's reset as well
+     * if the {@link SharedPreferences} say so.
+     *
+     * This is called from within the {@link FirmwareFlashTask}.
+     */
+    void skipFirmwareFlash() {
+        closeFirmwareFlash();
+    }
+
+    /**
+     * Ends the firmware update communication with the device, and triggers a reset based on
+     * the reset setting in the {@link SharedPreferences}.
      */
-    void finalizeFirmwareFlash() {
-        sendFinalize();
+    private void closeFirmwareFlash() {
         sendBye();
 
         SharedPreferences sharedPrefs = context.getSharedPreferences(
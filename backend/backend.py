@@ -49,11 +49,17 @@
 #   -> returns a JSON response containing the hash, e.g.:
 #   {"hash": "2bae9b9d4e46f8bfd7cb93ff27a79e841d124c3d"}
 #
+#   The hash is derived from the configuration content itself (along with the avr-gcc version and
+#   the device firmware sources), so requesting the same configuration again returns the same hash
+#   straight away, without building anything. New configurations are patched into a prebuilt
+#   template firmware (see template.py), only the template itself is actually compiled.
+#
 #
 # Request additional information from the build:
 #   curl -X GET -H "content-type: application/json" localhost:5544/firmware/2bae9b9d4e46f8bfd7cb93ff27a79e841d124c3d
 #
-#   -> returns JSON response containing size, binary file checksum, date, and the original config content
+#   -> returns JSON response containing size, compressed transfer size, binary file checksum, date,
+#      and the original config content
 #
 # Request the firmware file itself:
 #   curl -X GET -H "content-type: application/json" localhost:5544/firmware/2bae9b9d4e46f8bfd7cb93ff27a79e841d124c3d/bin -OJ
@@ -65,8 +71,228 @@ import hashlib
 import os
 import json
 import bottle
+import shutil
+import socketserver
 import subprocess
+import tempfile
+import threading
 import time
+import wsgiref.simple_server
+import lzpage
+import template
+
+
+# Device firmware sources that end up in every build, see buildme.sh
+SOURCE_DIR = '../device'
+SOURCE_FILES = ['light_ws2812.c', 'light_ws2812.h', 'main.c', 'Makefile', 'imghdr.py']
+
+_toolchain_version = None
+
+# Allowed range of each configuration value, so it fits into the firmware's configuration block
+# (see config_t and defaults_t in device/main.c) instead of getting silently cut off there
+CONFIG_LIMITS = dict(num_leds=(1, 0xffff), wait_color=(0, 0xffff), wait_gradient=(0, 0xffff),
+        gradient_steps=(1, 0xff))
+CONFIG_MAX_COLORS = 16
+
+# Builds currently running, by build key, see run_build()
+_builds = {}
+_builds_lock = threading.Lock()
+
+# Configuration the template firmware is built with, it's all patched over anyway
+TEMPLATE_CONFIG = dict(num_leds=1, wait_color=500, wait_gradient=10, gradient_steps=100,
+        colors=[dict(r=0, g=0, b=0)])
+
+# Loaded template firmwares by build key, None if the template build failed, see load_template()
+_templates = {}
+
+
+def toolchain_version():
+    """
+    Get the avr-gcc version string, or an empty string if there's no avr-gcc around.
+
+    The compiler won't change while the backend is running, so it's only asked once.
+    """
+    global _toolchain_version
+    if _toolchain_version is None:
+        try:
+            out = subprocess.check_output(['avr-gcc', '--version'], stderr=subprocess.DEVNULL)
+            _toolchain_version = out.decode('utf-8').splitlines()[0]
+        except (OSError, subprocess.CalledProcessError, IndexError):
+            _toolchain_version = ''
+    return _toolchain_version
+
+
+def source_version():
+    """
+    Get the SHA1 checksum over all device firmware source files.
+    """
+    sha = hashlib.sha1()
+    for filename in SOURCE_FILES:
+        with open('{}/{}'.format(SOURCE_DIR, filename), 'rb') as srcfile:
+            sha.update(filename.encode('utf-8'))
+            sha.update(srcfile.read())
+    return sha.hexdigest()
+
+
+def normalize_config(json_data):
+    """
+    Reduce the given JSON configuration data to the values that actually end up in the firmware.
+
+    Unknown keys are dropped and all values are turned into integers, so that configurations
+    that differ only in formatting, key order or extra data are considered identical.
+
+    Raises ValueError if any value is out of range, see CONFIG_LIMITS.
+    """
+    config = {key: int(json_data[key]) for key in CONFIG_LIMITS}
+    config['colors'] = [{key: int(c[key]) for key in ('r', 'g', 'b')} for c in json_data['colors']]
+
+    for key, (low, high) in CONFIG_LIMITS.items():
+        if not low <= config[key] <= high:
+            raise ValueError("{} out of range".format(key))
+    if not 0 < len(config['colors']) <= CONFIG_MAX_COLORS:
+        raise ValueError("need 1 to {} colors".format(CONFIG_MAX_COLORS))
+    if not all(0 <= c[key] <= 0xff for c in config['colors'] for key in ('r', 'g', 'b')):
+        raise ValueError("color out of range")
+    return config
+
+
+def build_key(config):
+    """
+    Get the build cache key for the given normalized configuration.
+
+    The key is the SHA1 checksum of the canonical JSON representation of the configuration, the
+    toolchain version and the source version, i.e. everything that determines the binary content.
+    """
+    canonical = json.dumps(config, sort_keys=True, separators=(',', ':'))
+    content = '\n'.join([canonical, toolchain_version(), source_version()])
+    return hashlib.sha1(content.encode('utf-8')).hexdigest()
+
+
+def created_header(config):
+    """
+    Get the created.h content for the ./buildme.sh script from the given normalized configuration.
+    """
+    out_data = """
+#define NUM_LEDS {num_leds:d}
+
+#define WAIT_COLOR_MS {wait_color:d}
+#define WAIT_GRADIENT_MS {wait_gradient:d}
+#define GRADIENT_STEPS {gradient_steps:d}
+
+""".format(**config)
+
+    # Add color definitions to the config data
+    out_data += "#define COLORS { \\\n"
+    for c in config['colors']:
+        out_data += "    {{ .r = {r:3}, .g = {g:3}, .b = {b:3} }}, \\\n".format(**c)
+    out_data += "}\n"
+
+    return out_data
+
+
+def run_build(key, client, out_data, config, options=()):
+    """
+    Run the ./buildme.sh script for the given build key, or wait for the one already running.
+
+    Concurrent requests for the same configuration share a single build, so when a bunch of
+    devices is reconfigured at once, there's only one compiler run per unique configuration.
+    Whoever comes first runs the script and writes the config.json file, everyone else just
+    waits for it to finish and gets the very same result.
+
+    Returns a tuple of the hash written from the ./buildme.sh script and its return code.
+    """
+    with _builds_lock:
+        build = _builds.get(key)
+        if build is not None:
+            waiting = True
+        else:
+            waiting = False
+            build = _builds[key] = dict(done=threading.Event(), hash="", returncode=-1)
+
+    if waiting:
+        print("firmware hash: {} (waiting for running build)".format(key))
+        build['done'].wait()
+        return build['hash'], build['returncode']
+
+    try:
+        # Call the script, opening up pipes for input and output to pass config data and get the hash back
+        process = subprocess.Popen(['./buildme.sh', '-k', key] + list(options) + [client], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        out, err = process.communicate(out_data.encode('utf-8'))
+        build['returncode'] = process.returncode
+        build['hash'] = out.decode('utf-8')
+
+        print("firmware hash: {}".format(build['hash']))
+        print("return code: {}".format(build['returncode']))
+
+        # Write the normalized content as config.json file to the build directory
+        build_dir = './build/{}'.format(build['hash'])
+        json_file = '{}/config.json'.format(build_dir)
+        if build['hash'] != "" and os.path.isdir(build_dir):
+            with open(json_file, 'w') as outfile:
+                json.dump(config, outfile)
+    finally:
+        with _builds_lock:
+            del _builds[key]
+        build['done'].set()
+
+    return build['hash'], build['returncode']
+
+
+def load_template():
+    """
+    Get the template firmware for the current toolchain and sources.
+
+    The template is built through the ./buildme.sh script the first time it's needed, and kept
+    around in memory afterwards. If the build fails, it's not tried again until the toolchain or
+    sources change, or the backend is restarted.
+
+    Returns the template.Template, or None if there's no usable template.
+    """
+    key = build_key(dict(TEMPLATE_CONFIG, template=True))
+    if key not in _templates:
+        firmware_hash, returncode = run_build(key, 'template', created_header(TEMPLATE_CONFIG), TEMPLATE_CONFIG, ['-t'])
+        build_dir = './build/{}'.format(key)
+        if returncode == 0:
+            _templates[key] = template.load('{}/ledmacher.bin'.format(build_dir), '{}/ledmacher.map'.format(build_dir))
+        else:
+            _templates[key] = None
+    return _templates[key]
+
+
+def patch_firmware(key, config):
+    """
+    Create the firmware for the given build key and normalized configuration from the template.
+
+    The build directory is set up under a temporary name and moved in place once it's complete,
+    so it's never seen half-written.
+
+    Returns True if the firmware was created, False if it needs to be built the regular way, i.e.
+    if there's no template, or the configuration has more LEDs than the template was built for.
+    """
+    firmware_template = load_template()
+    if firmware_template is None:
+        return False
+
+    firmware = firmware_template.patch(config, key)
+    if firmware is None:
+        return False
+
+    build_dir = './build/{}'.format(key)
+    tmp_dir = tempfile.mkdtemp(prefix='.{}.'.format(key), dir='./build')
+    with open('{}/ledmacher.bin'.format(tmp_dir), 'wb') as binfile:
+        binfile.write(firmware)
+    with open('{}/config.json'.format(tmp_dir), 'w') as outfile:
+        json.dump(config, outfile)
+
+    # Whatever a failed build may have left behind is replaced, an identical result is kept
+    if os.path.isdir(build_dir) and not os.path.isfile('{}/config.json'.format(build_dir)):
+        shutil.rmtree(build_dir, ignore_errors=True)
+    try:
+        os.rename(tmp_dir, build_dir)
+    except OSError:
+        shutil.rmtree(tmp_dir, ignore_errors=True)
+
+    return True
 
 
 @bottle.route('/')
@@ -82,6 +308,13 @@ def build_firmware():
     The configuration data is expected as JSON data within the POST request and used to create
     header file information for the ./buildme.sh script.
 
+    Builds are cached by their build key (see build_key()). If the same configuration was built
+    successfully before, its hash is returned right away without running ./buildme.sh at all.
+    Otherwise, the configuration is patched into the template firmware (see patch_firmware()),
+    and only if it has more LEDs than the template holds, the firmware is built from scratch.
+    Configurations that don't fit into any firmware are rejected with a 400 response right
+    away (see normalize_config()), no matter which way the firmware would be created.
+
     If the build succeeds, the hash returned from the ./buildme.sh script is sent as JSON data
     back to the caller, to be used for any future requests regarding the firmware itself.
 
@@ -91,45 +324,33 @@ def build_firmware():
     # Print and collect data about the request
     print(bottle.request)
     print(bottle.request.json)
-    json_data = bottle.request.json
     client = bottle.request.environ.get('REMOTE_ADDR')
-
-    # Collect configuration to be sent to the ./buildme.sh script
-    out_data = """
-#define NUM_LEDS {num_leds:d}
-
-#define WAIT_COLOR_MS {wait_color:d}
-#define WAIT_GRADIENT_MS {wait_gradient:d}
-#define GRADIENT_STEPS {gradient_steps:d}
-
-""".format(**json_data)
-
-    # Add color definitions to the config data
-    out_data += "struct cRGB colors[] = {\n"
-    for c in json_data['colors']:
-        out_data += "    {{ .r = {r:3}, .g = {g:3}, .b = {b:3} }},\n".format(**c)
-    out_data += "};\n"
-
-    # Call the script, opening up pipes for input and output to pass config data and get the hash back
-    process = subprocess.Popen(['./buildme.sh', client], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
-    out, err = process.communicate(out_data.encode('utf-8'))
-    returncode = process.returncode;
-    firmware_hash = out.decode('utf-8')
-
-    print("firmware hash: {}".format(firmware_hash))
-    print("return code: {}".format(returncode))
+    try:
+        json_data = normalize_config(bottle.request.json)
+    except (TypeError, KeyError, ValueError):
+        bottle.abort(400, "Invalid configuration")
+
+    # Check for a previous build of the same configuration. The config.json file is only written
+    # once the build is done, so a binary file of a build that's still running won't count.
+    key = build_key(json_data)
+    build_dir = './build/{}'.format(key)
+    if os.path.isfile('{}/ledmacher.bin'.format(build_dir)) and os.path.isfile('{}/config.json'.format(build_dir)):
+        print("firmware hash: {} (cached)".format(key))
+        return dict(hash=key)
+
+    # Patch the configuration into the template firmware if possible
+    if patch_firmware(key, json_data):
+        print("firmware hash: {} (patched)".format(key))
+        return dict(hash=key)
+
+    # Collect configuration to be sent to the ./buildme.sh script and build it
+    out_data = created_header(json_data)
+    firmware_hash, returncode = run_build(key, client, out_data, json_data)
 
     # If for whatever reason there's no hash written from the ./buildme.sh script, abort
     if firmware_hash is None or firmware_hash == "":
         # TODO dump the retrieved JSON data and build output to a log file, just in case
         bottle.abort(500, "Yeah, this didn't work")
-    
-    # Write the original content as config.json file to the build directory
-    build_dir = './build/{}'.format(firmware_hash)
-    json_file = '{}/config.json'.format(build_dir)
-    if os.path.isdir(build_dir):
-        with open(json_file, 'w') as outfile:
-            json.dump(json_data, outfile)
 
     # If all went well, return the hash, otherwise, don't
     if returncode == 0:
@@ -146,7 +367,8 @@ def get_firmware_info(firmware_hash):
 
     If the given firmware hash exists, all available information is collected and returned as JSON.
     Included information is the create time, binary file size, binary file SHA1 checksum, as weel as
-    the original configuration data content.
+    the original configuration data content. The compressed size tells how many bytes of memory page
+    data are sent if the firmware is transferred compressed (see lzpage.py).
 
     If the given firmware hash doesn't exist, 404 response is sent.
     """
@@ -160,13 +382,17 @@ def get_firmware_info(firmware_hash):
             config_data = json.load(json_file)
 
         created = int(os.path.getctime(config_file))
-        firmware_size = os.path.getsize(firmware_file)
-        firmware_checksum = hashlib.sha1(open(firmware_file, 'rb').read()).hexdigest()
+        with open(firmware_file, 'rb') as binfile:
+            firmware = binfile.read()
+        firmware_size = len(firmware)
+        firmware_checksum = hashlib.sha1(firmware).hexdigest()
+        compressed_size = lzpage.compressed_size(firmware)
 
         return dict(
                 build_hash=firmware_hash,
                 date=created,
                 size=firmware_size,
+                compressed_size=compressed_size,
                 checksum=firmware_checksum,
                 config=config_data)
 
@@ -198,8 +424,17 @@ def download_firmware(firmware_hash):
     bottle.abort(404, "Nope")
 
 
+class ThreadingWSGIServer(socketserver.ThreadingMixIn, wsgiref.simple_server.WSGIServer):
+    """
+    WSGI reference server handling each request in its own thread.
+
+    A build takes a few seconds, so without this, every other request would be stuck behind it.
+    """
+    daemon_threads = True
+
+
 if __name__ == '__main__':
-    bottle.run(host='0.0.0.0', port=5544)
+    bottle.run(host='0.0.0.0', port=5544, server_class=ThreadingWSGIServer)
 else:
     application = bottle.default_app()
     print("TODO: do something with this")
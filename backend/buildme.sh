@@ -30,7 +30,7 @@
 # script exits however successful or unsuccessful the built itself was.
 #
 # Usage
-#   cat sample.json.out | ./buildme.sh [<client string>]
+#   cat sample.json.out | ./buildme.sh [-k <build key>] [-t] [<client string>]
 #
 # Normally this is called from the backend.py Python script as part of the
 # whole build-from-app chain which converts a JSON file received from the
@@ -38,9 +38,17 @@
 # file can be used for testing.
 #
 # An optional client string can be given (e.g. IP address) that is used
-# when creating the session hash. A later version could actually just
-# use the hash of the config data itself, allowing to re-use previous
-# builds for identical configurations (something to consider at least).
+# when creating the session hash.
+#
+# If a build key is given with -k, it's used as hash instead of creating a
+# session-specific one. backend.py derives the key from the configuration
+# content and the toolchain and source versions, so identical requests end
+# up in the same build directory. If that directory already holds a binary
+# file, nothing is built at all and the key is written right back.
+#
+# With -t, the template firmware is built instead (see the template target
+# in device/Makefile), which backend.py patches configurations into rather
+# than running this script for each of them.
 #
 # NOTE: As the Python script is reading back the output and expecting
 # the session hash, all communication to the user / shell itself *MUST*
@@ -49,10 +57,21 @@
 
 # Check that there's data coming straight from stdin, or abort if not
 if [ ! -p /dev/stdin ] ; then
-    >&2 echo "Usage: <generate some output> | $0 [<client string>]"
+    >&2 echo "Usage: <generate some output> | $0 [-k <build key>] [-t] [<client string>]"
     exit 1
 fi
 
+build_key=""
+make_target="bin"
+while getopts "k:t" opt ; do
+    case $opt in
+        k) build_key="$OPTARG" ;;
+        t) make_target="template" ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
 BASE_DIR="./build/base"
 
 # Make sure the base build directory (i.e. the base for all session-specific
@@ -62,9 +81,14 @@ BASE_DIR="./build/base"
 # This way, there's no need to drag the build directory itself around in
 # version control, and cleaning up old builds can be as easy as just wiping
 # the entire build directory - it'll be back the next time it's needed.
+#
+# Several builds may be started at once, so the setup is done under a lock.
+mkdir -p build
+exec 8>build/base.lock
+flock 8
 if [ ! -d $BASE_DIR ] ; then
     SRC_DIR="$(readlink -f ../device)"
-    BUILD_SOURCE_FILES="light_ws2812.c light_ws2812.h main.c Makefile"
+    BUILD_SOURCE_FILES="light_ws2812.c light_ws2812.h main.c Makefile imghdr.py"
 
     >&2 echo "Build base directory doesn't exist, setting it up"
     mkdir -p $BASE_DIR
@@ -77,20 +101,43 @@ if [ ! -d $BASE_DIR ] ; then
         ln -s $SRC_DIR/$file $BASE_DIR/$file
     done
 fi
+flock -u 8
 
 
-# Create session-specific build hash
+# Create session-specific build hash, unless a build key was given
 # The hash is just the SHA1 checksum of the given client ID and the current
 # time's string representation concatenated to "<client> <date string>"
 client="$1"
 now=$(date)
-build_hash=$(echo $client $now | sha1sum | cut -d\  -f 1)
+if [ -n "$build_key" ] ; then
+    build_hash=$build_key
+else
+    build_hash=$(echo $client $now | sha1sum | cut -d\  -f 1)
+fi
 
 # Create session-specific build directory simply named like the hash
 build_dir=build/$build_hash
 
-# Copy base directory to session-specific build directory
+# Only one build per key at a time. backend.py already makes concurrent
+# requests for the same configuration share a single build, but that won't
+# help when it's running in several processes, so wait here for any other
+# build of the same key to finish - it's most likely a cache hit afterwards.
+if [ -n "$build_key" ] ; then
+    exec 9>build/$build_hash.lock
+    flock 9
+fi
+
+# Nothing to do if there's a successful build for the key already
+if [ -f $build_dir/ledmacher.bin ] ; then
+    >&2 echo "Reusing $build_hash"
+    echo -n $build_hash
+    exit 0
+fi
+
+# Copy base directory to session-specific build directory, replacing
+# whatever a previously failed build for the same key left behind
 >&2 echo "Creating $build_hash"
+rm -rf $build_dir
 cp -ar build/base $build_dir
 
 # Create header file and dump given input stream into it
@@ -107,6 +154,9 @@ cat > $header << EOF
 #ifndef _CREATED_H_
 #define _CREATED_H_
 
+/* First 8 bytes of the build hash, stored in the application image header */
+#define BUILD_HASH { $(echo ${build_hash:0:16} | sed 's/../0x&, /g') }
+
 EOF
 
 while IFS= read line ; do
@@ -119,13 +169,15 @@ cat >> $header << EOF
 EOF
 
 # Run make to create the .bin file and dump the output to a log file
-make -C $build_dir bin >$build_dir/build.log 2>&1
+make -C $build_dir $make_target >$build_dir/build.log 2>&1
 declare -i build_retval=$?
 
-# If build fails, print the log to stderr
+# If build fails, print the log to stderr, and make sure there's no binary
+# file left behind that could be mistaken for a successful build later on
 if [ $build_retval -ne 0 ] ; then
     >&2 echo "BUILD FAILED!"
     >&2 cat $build_dir/build.log
+    rm -f $build_dir/ledmacher.bin
 fi
 
 # Print hash either way, the Python script will check the return value
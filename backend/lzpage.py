@@ -0,0 +1,253 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Backend - Memory Page Compressor
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Compresses a firmware binary memory page by memory page into the LZSS
+# format the bootloader unpacks (see the format description at the top of
+# bootloader/main.c). Each page is compressed on its own, but may refer
+# back into all the previous pages, as the bootloader uses the already
+# flashed firmware as its dictionary.
+#
+# Usage
+#   ./lzpage.py <firmware.bin>
+#
+# Prints the per-page compression results along with an estimate of the
+# time spent on the USB bus for sending the firmware raw and compressed.
+#
+
+import sys
+
+
+PAGE_SIZE = 128
+MIN_MATCH = 3
+MAX_MATCH = MIN_MATCH + 0x0f
+MAX_OFFSET = 0x1000
+MAX_CHAIN = 256
+
+# Low-speed USB moves 8 bytes per control transfer data packet, and the
+# device is polled roughly once per millisecond frame for each of them.
+# On top of that, each page costs a setup and status stage, a verify
+# request with its own data stage, and the time to erase and write it.
+BYTES_PER_MS = 8
+REQUEST_OVERHEAD_MS = 4
+PROGRAM_MS = 9
+
+# Chunk header in front of each page's data: 16-bit page number and 8-bit
+# size, see CHUNK_HEADER_SIZE in bootloader/main.c and HEADER_SIZE in the
+# app's UsbHandler.java
+HEADER_SIZE = 3
+
+
+def _hash(data, pos):
+    return data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16)
+
+
+def compress_page(image, offset, length, chains=None):
+    """
+    Compress a single memory page of the given firmware image.
+
+    The page starts at the given offset and is length bytes long. All data
+    before offset is considered to be flashed already and is used as
+    dictionary. The optional chains dict keeps the match lookup state
+    between consecutive pages of the same image.
+
+    Returns the compressed data, or None if compressing doesn't pay off
+    and the page should be sent raw instead.
+    """
+    if chains is None:
+        chains = {}
+
+    end = offset + length
+    out = bytearray()
+    flags_pos = 0
+    item = 8
+    pos = offset
+
+    # Add the previous pages' positions first, if not done yet
+    start = chains.get('next', 0)
+    for p in range(start, offset):
+        if p + MIN_MATCH <= len(image):
+            chains.setdefault(_hash(image, p), []).append(p)
+    chains['next'] = max(start, offset)
+
+    while pos < end:
+        if item == 8:
+            flags_pos = len(out)
+            out.append(0)
+            item = 0
+
+        best_len = 0
+        best_off = 0
+        if pos + MIN_MATCH <= end:
+            candidates = chains.get(_hash(image, pos), [])
+            max_len = min(MAX_MATCH, end - pos)
+            for cand in reversed(candidates[-MAX_CHAIN:]):
+                if pos - cand > MAX_OFFSET:
+                    break
+                n = 0
+                while n < max_len and image[cand + n] == image[pos + n]:
+                    n += 1
+                if n > best_len:
+                    best_len = n
+                    best_off = pos - cand
+                    if n == max_len:
+                        break
+
+        if best_len >= MIN_MATCH:
+            code = best_off - 1
+            out.append(((code >> 4) & 0xf0) | (best_len - MIN_MATCH))
+            out.append(code & 0xff)
+            step = best_len
+        else:
+            out[flags_pos] |= (1 << item)
+            out.append(image[pos])
+            step = 1
+
+        for p in range(pos, pos + step):
+            if p + MIN_MATCH <= len(image):
+                chains.setdefault(_hash(image, p), []).append(p)
+        chains['next'] = pos + step
+        pos += step
+        item += 1
+
+    if len(out) >= length:
+        return None
+    return bytes(out)
+
+
+def decompress_page(image, offset, data):
+    """
+    Unpack a single compressed memory page the same way the bootloader does.
+
+    The given image contains the previously unpacked pages, i.e. everything
+    up to offset. Returns the unpacked page data.
+    """
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        flags = data[pos]
+        pos += 1
+        for item in range(8):
+            if pos >= len(data):
+                break
+            if flags & (1 << item):
+                out.append(data[pos])
+                pos += 1
+            else:
+                code = ((data[pos] & 0xf0) << 4) | data[pos + 1]
+                length = (data[pos] & 0x0f) + MIN_MATCH
+                source = offset + len(out) - (code + 1)
+                pos += 2
+                for _ in range(length):
+                    if source >= offset:
+                        out.append(out[source - offset])
+                    else:
+                        out.append(image[source])
+                    source += 1
+    return bytes(out)
+
+
+def compress_image(image, page_size=PAGE_SIZE):
+    """
+    Compress a whole firmware image memory page by memory page.
+
+    Returns a list of compressed page data, with None for every page that
+    is better off sent raw.
+    """
+    chains = {}
+    pages = []
+    for offset in range(0, len(image), page_size):
+        length = min(page_size, len(image) - offset)
+        pages.append(compress_page(image, offset, length, chains))
+    return pages
+
+
+def compressed_size(image, page_size=PAGE_SIZE):
+    """
+    Get the total number of memory page data bytes sent for a compressed transfer.
+
+    Pages that don't compress are counted with their raw size.
+    """
+    total = 0
+    for index, data in enumerate(compress_image(image, page_size)):
+        if data is None:
+            total += min(page_size, len(image) - index * page_size)
+        else:
+            total += len(data)
+    return total
+
+
+def transfer_time_ms(payload_sizes):
+    """
+    Estimate the time in milliseconds to send pages of the given sizes.
+    """
+    total = 0
+    for size in payload_sizes:
+        packets = (HEADER_SIZE + size + BYTES_PER_MS - 1) // BYTES_PER_MS
+        total += REQUEST_OVERHEAD_MS + packets + PROGRAM_MS
+        total += REQUEST_OVERHEAD_MS + PAGE_SIZE // BYTES_PER_MS
+    return total
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: {} <firmware.bin>".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as binfile:
+        image = binfile.read()
+
+    pages = compress_image(image)
+    raw_sizes = []
+    sent_sizes = []
+    unpacked = bytearray()
+
+    for index, data in enumerate(pages):
+        offset = index * PAGE_SIZE
+        length = min(PAGE_SIZE, len(image) - offset)
+        raw_sizes.append(length)
+
+        if data is None:
+            sent_sizes.append(length)
+            unpacked += image[offset:offset + length]
+            print("page {:3d}: {:3d} bytes raw".format(index, length))
+        else:
+            sent_sizes.append(len(data))
+            unpacked += decompress_page(unpacked, offset, data)
+            print("page {:3d}: {:3d} -> {:3d} bytes".format(index, length, len(data)))
+
+    if bytes(unpacked) != image:
+        print("ERROR: unpacked data doesn't match the original image", file=sys.stderr)
+        sys.exit(1)
+
+    print("")
+    print("total:     {:5d} -> {:5d} bytes ({:.1f}%)".format(
+        sum(raw_sizes), sum(sent_sizes), 100.0 * sum(sent_sizes) / max(1, sum(raw_sizes))))
+    print("estimated: {:5d} -> {:5d} ms".format(
+        transfer_time_ms(raw_sizes), transfer_time_ms(sent_sizes)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Backend - Template Firmware Patcher
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Creates firmware binaries for a given configuration by patching it into
+# the default configuration block of a prebuilt template firmware (see the
+# template target in device/Makefile), instead of compiling the firmware
+# for each and every configuration. The block's address is looked up from
+# the template's linker map, the image header is fixed up afterwards with
+# the same code the device Makefile uses (see device/imghdr.py).
+#
+# Usage
+#   ./template.py <template.bin> <template.map> <config.json> <firmware.bin>
+#
+# The configuration is given in the same JSON format the backend receives
+# from the app (see sample.json). The only limit that's up to the template
+# is the number of LEDs it was built for (see TEMPLATE_MAX_LEDS in
+# device/Makefile), configurations with more LEDs need a regular build.
+# All other values end up in the same configuration block either way, so
+# a regular build can't hold any more colors or larger values than the
+# template. Those are rejected, just like the backend rejects them for
+# any build (see normalize_config() in backend.py).
+#
+
+import importlib.util
+import json
+import os
+import re
+import struct
+import sys
+
+
+# Default configuration block layout, see defaults_t in device/main.c
+DEFAULTS_SYMBOL = 'config_defaults'
+DEFAULTS_FORMAT = '<IHHHIHHBB48s'
+DEFAULTS_SIZE = struct.calcsize(DEFAULTS_FORMAT)
+DEFAULTS_MAGIC = 0x4645444c
+CONFIG_MAGIC = 0x434c
+CONFIG_MAX_COLORS = 16
+
+# The image header code is shared with the device Makefile
+_spec = importlib.util.spec_from_file_location('device_imghdr',
+        os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'device', 'imghdr.py'))
+imghdr = importlib.util.module_from_spec(_spec)
+_spec.loader.exec_module(imghdr)
+
+
+def find_defaults(mapfile):
+    """
+    Get the flash address of the default configuration block from the given linker map content.
+
+    Returns the address, or None if the symbol isn't listed in the map.
+    """
+    match = re.search(r'^\s+0x([0-9a-f]+)\s+{}$'.format(DEFAULTS_SYMBOL), mapfile, re.MULTILINE)
+    if match is None:
+        return None
+    return int(match.group(1), 16)
+
+
+class Template:
+    """
+    Template firmware image with the address of its default configuration block.
+    """
+
+    def __init__(self, image, address):
+        self.image = image
+        self.address = address
+        magic, self.max_leds = struct.unpack_from('<IH', image, address)
+        if magic != DEFAULTS_MAGIC:
+            raise ValueError("no default configuration at 0x{:04x}".format(address))
+
+    def patch(self, config, build_hash):
+        """
+        Create a firmware image for the given normalized configuration.
+
+        The build hash is written to the image header just like a regular build does it.
+
+        Returns the firmware image, or None if the configuration has more LEDs than the template
+        was built for. Raises ValueError if it doesn't fit into any firmware at all.
+        """
+        colors = config['colors']
+        if not (0 < len(colors) <= CONFIG_MAX_COLORS and
+                0 < config['gradient_steps'] <= 0xff and
+                0 <= config['wait_color'] <= 0xffff and
+                0 <= config['wait_gradient'] <= 0xffff and
+                0 < config['num_leds'] <= 0xffff and
+                all(0 <= c[key] <= 0xff for c in colors for key in ('r', 'g', 'b'))):
+            raise ValueError("configuration out of range")
+        if config['num_leds'] > self.max_leds:
+            return None
+
+        # Colors are stored in the LEDs' native GRB order
+        color_data = b''.join(struct.pack('BBB', c['g'], c['r'], c['b']) for c in colors)
+
+        image = bytearray(self.image)
+        struct.pack_into(DEFAULTS_FORMAT, image, self.address,
+                DEFAULTS_MAGIC,
+                self.max_leds,
+                config['num_leds'],
+                CONFIG_MAGIC,
+                0,
+                config['wait_color'],
+                config['wait_gradient'],
+                config['gradient_steps'],
+                len(colors),
+                color_data)
+        struct.pack_into('8s', image, imghdr.HEADER_OFFSET + 6, bytes.fromhex(build_hash[:16]))
+
+        return imghdr.patch_header(bytes(image))
+
+
+def load(binfile_path, mapfile_path):
+    """
+    Load a template firmware from the given binary and linker map files.
+
+    Returns the Template, or None if there's no default configuration block to be found.
+    """
+    with open(mapfile_path) as mapfile:
+        address = find_defaults(mapfile.read())
+    with open(binfile_path, 'rb') as binfile:
+        image = binfile.read()
+
+    if address is None or address + DEFAULTS_SIZE > len(image):
+        return None
+    try:
+        return Template(image, address)
+    except ValueError:
+        return None
+
+
+def main():
+    if len(sys.argv) != 5:
+        print("Usage: {} <template.bin> <template.map> <config.json> <firmware.bin>".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    template = load(sys.argv[1], sys.argv[2])
+    if template is None:
+        print("ERROR: no default configuration found in {}".format(sys.argv[1]), file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[3]) as json_file:
+        config = json.load(json_file)
+
+    try:
+        image = template.patch(config, '0' * 16)
+    except ValueError as e:
+        print("ERROR: {}".format(e), file=sys.stderr)
+        sys.exit(1)
+    if image is None:
+        print("ERROR: template only holds up to {} LEDs".format(template.max_leds), file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[4], 'wb') as binfile:
+        binfile.write(image)
+
+    print("default configuration at 0x{:04x}, up to {} LEDs".format(template.address, template.max_leds))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Bootloader - Configuration Update
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Writes a new runtime configuration to the EEPROM of a connected
+# Ledmacher Bootloader device, without touching the application firmware
+# itself. The configuration is given in the same JSON format the backend
+# uses to build the firmware (see backend/sample.json), the number of
+# LEDs is ignored though, as that's fixed in the firmware.
+#
+# The configuration is tied to the firmware currently on the device via
+# the CRC32 in its image header, and is ignored once a different firmware
+# is flashed. So update the firmware first, then write the configuration.
+#
+# Usage
+#   ./config.py <config.json>
+#
+# Requires pyusb and a bootloader version 1.7 or newer. The application
+# picks up the new configuration after the next reset, see config_load()
+# in device/main.c for the matching layout.
+#
+
+import json
+import struct
+import sys
+import usb.core
+
+
+USB_VENDOR_ID = 0x1209
+USB_DEVICE_ID = 0xb00b
+USB_SEND = 0x40
+USB_RECV = 0xc0
+
+CMD_HELLO = 0x01
+CMD_FLASH_READ = 0x15
+CMD_EEPROM_READ = 0x20
+CMD_EEPROM_WRITE = 0x21
+CMD_BYE = 0xf0
+HELLO_VALUE = 0x4d6f
+HELLO_INDEX = 0x6921
+
+# Application image header, see image_header_t in device/main.c
+IMAGE_HEADER_ADDR = 0x68
+IMAGE_HEADER_FORMAT = '<IH8sI'
+IMAGE_MAGIC = 0x4d44454c
+
+CONFIG_ADDR = 0
+CONFIG_MAGIC = 0x434c
+CONFIG_MAX_COLORS = 16
+
+
+def pack_config(config, image_crc):
+    """
+    Pack the given configuration dict into the binary EEPROM layout,
+    for the firmware image with the given CRC32.
+    """
+    colors = config['colors']
+    if not 0 < len(colors) <= CONFIG_MAX_COLORS:
+        raise ValueError("need 1 to {} colors".format(CONFIG_MAX_COLORS))
+    if not 0 < config['gradient_steps'] <= 0xff:
+        raise ValueError("need 1 to 255 gradient steps")
+
+    data = struct.pack('<HIHHBB',
+            CONFIG_MAGIC,
+            image_crc,
+            config['wait_color'],
+            config['wait_gradient'],
+            config['gradient_steps'],
+            len(colors))
+
+    # Colors are stored in the LEDs' native GRB order
+    for color in colors:
+        data += struct.pack('BBB', color['g'], color['r'], color['b'])
+
+    return data
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: {} <config.json>".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[1]) as json_file:
+        config = json.load(json_file)
+    # Check the configuration before talking to the device
+    pack_config(config, 0)
+
+    device = usb.core.find(idVendor=USB_VENDOR_ID, idProduct=USB_DEVICE_ID)
+    if device is None:
+        print("ERROR: no Ledmacher Bootloader device found", file=sys.stderr)
+        sys.exit(1)
+
+    banner = bytes(device.ctrl_transfer(USB_RECV, CMD_HELLO, HELLO_VALUE, HELLO_INDEX, 128))
+    print(banner.split(b'\0')[0].decode('ascii', 'replace'))
+
+    header = bytes(device.ctrl_transfer(USB_RECV, CMD_FLASH_READ, IMAGE_HEADER_ADDR, 0,
+            struct.calcsize(IMAGE_HEADER_FORMAT)))
+    magic, _, _, image_crc = struct.unpack(IMAGE_HEADER_FORMAT, header)
+    if magic != IMAGE_MAGIC:
+        device.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0, None)
+        print("ERROR: no application image header on the device", file=sys.stderr)
+        sys.exit(1)
+
+    data = pack_config(config, image_crc)
+    device.ctrl_transfer(USB_SEND, CMD_EEPROM_WRITE, CONFIG_ADDR, 0, data)
+    verify = bytes(device.ctrl_transfer(USB_RECV, CMD_EEPROM_READ, CONFIG_ADDR, 0, len(data)))
+    device.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0, None)
+
+    if verify != data:
+        print("ERROR: configuration verification failed", file=sys.stderr)
+        sys.exit(1)
+
+    print("wrote {} bytes of configuration".format(len(data)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Bootloader - Flash Memory Dump
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Reads back the application flash memory of a connected Ledmacher
+# Bootloader device in a single CMD_FLASH_READ request, either to save
+# a snapshot of it, or to verify it against a given firmware file.
+#
+# Usage
+#   ./dump.py read <output file> [<length>]
+#   ./dump.py verify <firmware.bin>
+#
+# Without a length, the entire application section is read, as large as
+# the bootloader's capability block says it is. Requires pyusb and a
+# bootloader version 1.8 or newer that supports flash read-back.
+#
+
+import struct
+import sys
+import usb.core
+
+
+USB_VENDOR_ID = 0x1209
+USB_DEVICE_ID = 0xb00b
+USB_SEND = 0x40
+USB_RECV = 0xc0
+USB_TIMEOUT_MS = 10000
+
+CMD_HELLO = 0x01
+CMD_FLASH_READ = 0x15
+CMD_BYE = 0xf0
+HELLO_VALUE = 0x4d6f
+HELLO_INDEX = 0x6921
+
+# Capability block offsets, see capabilities_t in main.c
+CAPS_APP_SIZE = 5
+CAPS_FEATURES = 11
+FEATURE_FLASH_READ = 0x08
+
+
+def read_flash(length):
+    """
+    Read the given number of bytes of application flash memory from the device,
+    or the entire application section if the length is None.
+
+    Returns the read data, which is shorter than the given length if it
+    reaches beyond the flash memory below the bootloader.
+    """
+    device = usb.core.find(idVendor=USB_VENDOR_ID, idProduct=USB_DEVICE_ID)
+    if device is None:
+        print("ERROR: no Ledmacher Bootloader device found", file=sys.stderr)
+        sys.exit(1)
+
+    reply = bytes(device.ctrl_transfer(USB_RECV, CMD_HELLO, HELLO_VALUE, HELLO_INDEX, 128))
+    banner, _, caps = reply.partition(b'\0')
+    print(banner.decode('ascii', 'replace'), file=sys.stderr)
+
+    if len(caps) <= CAPS_FEATURES or caps[0] <= CAPS_FEATURES or \
+            not caps[CAPS_FEATURES] & FEATURE_FLASH_READ:
+        device.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0, None)
+        print("ERROR: bootloader has no flash read-back", file=sys.stderr)
+        sys.exit(1)
+
+    if length is None:
+        length = struct.unpack_from('<H', caps, CAPS_APP_SIZE)[0]
+    data = bytes(device.ctrl_transfer(USB_RECV, CMD_FLASH_READ, 0, 0, length, USB_TIMEOUT_MS))
+    device.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0, None)
+    return data
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[1] not in ('read', 'verify') or \
+            (sys.argv[1] == 'verify' and len(sys.argv) != 3) or len(sys.argv) > 4:
+        print("Usage: {} read <output file> [<length>]".format(sys.argv[0]), file=sys.stderr)
+        print("       {} verify <firmware.bin>".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    if sys.argv[1] == 'read':
+        length = int(sys.argv[3], 0) if len(sys.argv) == 4 else None
+        data = read_flash(length)
+        with open(sys.argv[2], 'wb') as outfile:
+            outfile.write(data)
+        print("read {} bytes".format(len(data)), file=sys.stderr)
+        return
+
+    with open(sys.argv[2], 'rb') as binfile:
+        firmware = binfile.read()
+
+    data = read_flash(len(firmware))
+    for offset in range(len(firmware)):
+        if offset >= len(data) or data[offset] != firmware[offset]:
+            print("MISMATCH at 0x{:04x}".format(offset), file=sys.stderr)
+            sys.exit(1)
+
+    print("verified {} bytes".format(len(firmware)), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1134 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "usbdrv.h"
+#include "sim.h"
+
+/*
+ * Bootloader protocol harness
+ *
+ * Replays a complete firmware update session against the bootloader
+ * running in the host simulation (see sim.h), the same way the app's
+ * UsbHandler does it: HELLO, INIT, optional erase-ahead, the memory
+ * pages in windows, resending whatever chunks weren't acknowledged, or
+ * in multi-page transfers, each verified either via the READY
+ * notification's CRC32 or by reading it back, then FINALIZE and CRC.
+ * If the CRC32 doesn't match, the update is started over like a user
+ * would, otherwise it ends with BYE and RESET. After the device reset,
+ * it's booted once more without the enable pin to check it starts the
+ * application.
+ *
+ * Memory pages can be compressed the same way lzpage.py and the app do
+ * it, sending consecutive compressed or raw pages together like the
+ * app's FirmwareFlashTask. Before the update, a few bytes are written to
+ * EEPROM and read back, and a write into the bootloader's reserved part
+ * of it is checked to be ignored.
+ *
+ * Like the app, the harness looks at the endpoints of the configuration
+ * descriptor the bootloader build has. Without interrupt-IN endpoint, as
+ * in the lean build, it verifies by reading back even if the capability
+ * block claims notifications, and reports those as an error. Without long
+ * transfers, a control transfer of more than 254 bytes is an error, too.
+ *
+ * If the bootloader is built with -DTIMING, its timing histograms are
+ * read right after the update, and their summary is printed. If it's
+ * built with -DTRACE, its event trace is read and checked to name only
+ * pages of the image as written.
+ *
+ * The USB bus is modeled with one packet per 1ms frame, the same rough
+ * estimate lzpage.py uses. Packets can get lost, which the host
+ * controller resends in the next frame, or data sent to the device can
+ * get corrupted, which V-USB doesn't notice as it doesn't check the CRC
+ * of received data, so only the protocol's own verification can.
+ *
+ * Usage
+ *   ./harness [-l <loss %>] [-c <corrupt %>] [-n <pages>] [-s <seed>]
+ *             [-r <size>] [-z] [-d] [-W] [-V] [-E] [-i] [-v] [<firmware.bin>]
+ *
+ *   -l   chance of each packet getting lost, in percent
+ *   -c   chance of each data packet sent to the device getting corrupted,
+ *        in percent
+ *   -n   memory pages per transfer or window, default 8 like the app,
+ *        or the bootloader's window size
+ *   -s   random seed, for the image and the packet errors
+ *   -r   use a random image of the given size instead of a file,
+ *        with -z mostly made of repeats of recent data, so most pages
+ *        compress and refer back into the previous page
+ *   -z   send compressed memory pages where it pays off
+ *   -d   leave out the first chunk of each window the first time it's
+ *        sent, so the following ones arrive without it
+ *   -W   don't send windows, even if the bootloader supports them
+ *   -V   always verify by reading back, even with notifications,
+ *        only without windows
+ *   -E   don't erase ahead, even if the bootloader supports it
+ *   -i   afterwards, boot again with the enable pin held and wait for
+ *        the idle timeout to start the application, see IDLE_TIMEOUT
+ *   -v   print the bootloader's UART output
+ *
+ * Exits with 0 if the update went through and the flash memory holds the
+ * image afterwards, without any self-programming rule being broken.
+ */
+
+/* Protocol definitions, see ../main.c */
+#define CMD_HELLO               0x01
+#define CMD_FWUPDATE_INIT       0x10
+#define CMD_FWUPDATE_MEMPAGE    0x11
+#define CMD_FWUPDATE_VERIFY     0x12
+#define CMD_FWUPDATE_FINALIZE   0x13
+#define CMD_FWUPDATE_CRC        0x14
+#define CMD_FWUPDATE_ERASE      0x16
+#define CMD_FWUPDATE_ACK        0x18
+#define CMD_EEPROM_READ         0x20
+#define CMD_EEPROM_WRITE        0x21
+#define CMD_TRACE               0x30
+#define CMD_TIMING              0x31
+#define CMD_BYE                 0xf0
+#define CMD_RESET               0xfa
+
+#define HELLO_VALUE 0x4d6f
+#define HELLO_INDEX 0x6921
+#define MEMPAGE_RAW 0
+#define MEMPAGE_COMPRESSED 1
+#define MEMPAGE_WINDOW 2
+#define CHUNK_HEADER_SIZE 3
+#define WINDOW_HEADER_SIZE (CHUNK_HEADER_SIZE + 1)
+#define WINDOW_CRC_SIZE 2
+
+#define CAPS_PAGE_SIZE      3
+#define CAPS_APP_SIZE       5
+#define CAPS_MAX_TRANSFER   7
+#define CAPS_FEATURES       11
+#define CAPS_MIN_SIZE       12
+#define CAPS_FEATURES_EXT   12
+#define CAPS_PROTOCOL       13
+#define CAPS_WINDOW_SIZE    14
+
+#define FEATURE_COMPRESSION 0x01
+#define FEATURE_MULTI_PAGE  0x02
+#define FEATURE_EEPROM      0x10
+#define FEATURE_TRACE       0x20
+#define FEATURE_ERASE_AHEAD 0x40
+#define FEATURE_NOTIFY      0x80
+#define FEATURE_EXT_WEAR    0x01
+#define FEATURE_EXT_TIMING  0x02
+
+#define PROTOCOL_WINDOW     2
+
+#define NOTIFY_ERROR        0x02
+#define NOTIFY_READY        0x03
+
+/** Application state record address and valid state, see app_record_t in ../main.c */
+#define APP_RECORD_ADDR (E2END + 1 - 7)
+#define APP_STATE_VALID 0xa5
+/** Wear counters address and layout, see WEAR_ADDR in ../main.c */
+#define WEAR_BLOCK_PAGES 4
+#define WEAR_COUNTERS ((FLASHEND + 1) / SPM_PAGESIZE / WEAR_BLOCK_PAGES)
+#define WEAR_ADDR (E2END + 1 - 32 - WEAR_COUNTERS * 2)
+
+/** Compressed memory page format, see ../main.c and lzpage.py */
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 0x0f)
+#define LZ_MAX_OFFSET 0x1000
+
+/** USB request types */
+#define USB_SEND 0x40
+#define USB_RECV 0xc0
+
+/** Bus time per packet in microseconds */
+#define PACKET_US 1000
+/** Number of endpoints besides the control endpoint in the configuration descriptor */
+#define ENDPOINTS (USB_CFG_HAVE_INTRIN_ENDPOINT + USB_CFG_HAVE_INTRIN_ENDPOINT3)
+/** Interrupt endpoint polling interval in microseconds */
+#define INTR_POLL_US (USB_CFG_INTR_POLL_INTERVAL * 1000UL)
+/** Request timeout in microseconds, same as the app's */
+#define TIMEOUT_US 2000000UL
+/** Memory pages per transfer, same as the app's */
+#define PAGES_PER_TRANSFER 8
+/** Maximum number of chunks in a window */
+#define MAX_WINDOW_SIZE 16
+/** Attempts for a single transfer until giving up */
+#define MAX_ATTEMPTS 100
+/** Attempts for the whole update until giving up */
+#define MAX_UPDATES 3
+/** Timing histograms, see timing_buffer_t in ../timing.h */
+#define TIMING_PHASES 4
+#define TIMING_BUCKETS 16
+#define TIMING_HISTOGRAM_SIZE (TIMING_BUCKETS * 2 + 2 + 4)
+/** Event trace, see trace_buffer_t in ../trace.h */
+#define TRACE_ENTRIES 128
+#define TRACE_ENTRY_SIZE 5
+#define TRACE_WRITE_END 0x05
+/** Timer1 tick in microseconds */
+#define TIMING_TICK_US (256 / (F_CPU / 1e6))
+/** Maximum firmware size */
+#define MAX_IMAGE_SIZE BOOTLOAD_ADDR
+/** Maximum number of memory pages in the firmware */
+#define MAX_PAGES (MAX_IMAGE_SIZE / SPM_PAGESIZE)
+/** Number of bytes written to EEPROM and read back */
+#define EEPROM_TEST_SIZE 16
+
+/** Command line options */
+static struct {
+    double loss;
+    double corrupt;
+    unsigned int pages_per_transfer;
+    unsigned int seed;
+    uint8_t no_window;
+    uint8_t readback;
+    uint8_t no_erase;
+    uint8_t compress;
+    uint8_t drop;
+    uint8_t idle;
+} opt = {
+    .seed = 1,
+};
+
+/** Session statistics */
+static struct {
+    uint32_t packets;
+    uint32_t lost;
+    uint32_t corrupted;
+    uint32_t retries;
+    uint32_t resent;
+    uint32_t restarts;
+    uint32_t naks;
+    uint32_t update_start;
+    uint32_t update_end;
+    uint32_t compressed;
+    uint32_t packed_bytes;
+    uint8_t wear;
+    uint8_t ok;
+} stats;
+
+/** Firmware image to flash */
+static uint8_t image[MAX_IMAGE_SIZE];
+/** Firmware image size */
+static uint16_t image_len;
+/** Compressed data of each memory page, see compress_page() */
+static uint8_t packed[MAX_PAGES][SPM_PAGESIZE + 3];
+/** Compressed size of each memory page, 0 if it's sent raw */
+static uint16_t packed_len[MAX_PAGES];
+/** Simulated time of the next interrupt endpoint poll */
+static uint32_t next_intr_poll;
+
+
+/**
+ * Roll the dice for a packet error with the given chance in percent.
+ */
+static int
+chance(double percent)
+{
+    return percent > 0 && rand() < percent / 100 * RAND_MAX;
+}
+
+/**
+ * Transfer a single packet on the bus.
+ *
+ * Gives the bootloader a main loop iteration first, as V-USB only takes
+ * the next packet once the previous one was handled in usbPoll(). Any
+ * packet to the device is NAKed and retried in the next frame while the
+ * bootloader has all requests disabled.
+ *
+ * @param out 1 if the packet is sent to the device, 0 if it's from it
+ */
+static void
+bus_packet(int out)
+{
+    sim_yield();
+#if USB_CFG_HAVE_FLOWCONTROL
+    while (out && usbAllRequestsAreDisabled()) {
+        sim_time += PACKET_US;
+        stats.naks++;
+        sim_yield();
+    }
+#else
+    (void) out;
+#endif
+    sim_time += PACKET_US;
+    stats.packets++;
+
+    while (chance(opt.loss)) {
+        sim_time += PACKET_US;
+        stats.lost++;
+    }
+}
+
+/**
+ * Send the setup packet of a control transfer.
+ *
+ * Without long transfers, V-USB can't handle more than 254 bytes in a
+ * control transfer, so the host has to keep within that.
+ */
+static usbMsgLen_t
+setup(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length)
+{
+    uchar data[8] = {
+        type, request,
+        value & 0xff, value >> 8,
+        index & 0xff, index >> 8,
+        length & 0xff, length >> 8,
+    };
+
+#if !USB_CFG_LONG_TRANSFERS
+    if (length > 254) {
+        fprintf(stderr, "ERROR: %u byte transfer without long transfers\n", length);
+        exit(1);
+    }
+#endif
+    bus_packet(1);
+    return usbFunctionSetup(data);
+}
+
+/**
+ * Perform a control transfer sending data to the device.
+ *
+ * @return 0 on success, -1 if the device stalled the request
+ */
+static int
+ctrl_out(uint8_t request, uint16_t value, uint16_t index, const uint8_t *data, uint16_t len)
+{
+    usbMsgLen_t ret = setup(USB_SEND, request, value, index, len);
+    uint8_t accept = (len > 0 && ret == USB_NO_MSG);
+    uint16_t sent;
+    uchar packet[8];
+
+    for (sent = 0; sent < len; sent += 8) {
+        uint8_t n = (len - sent < 8) ? len - sent : 8;
+
+        memcpy(packet, data + sent, n);
+        bus_packet(1);
+        if (chance(opt.corrupt)) {
+            packet[rand() % n] ^= 1 << (rand() % 8);
+            stats.corrupted++;
+        }
+        if (accept) {
+            uchar done = usbFunctionWrite(packet, n);
+            if (done == 0xff) {
+                return -1;
+            }
+            accept = !done;
+        }
+    }
+
+    /* Status stage */
+    bus_packet(0);
+    return 0;
+}
+
+/**
+ * Perform a control transfer receiving data from the device.
+ *
+ * @return Number of bytes received
+ */
+static uint16_t
+ctrl_in(uint8_t request, uint16_t value, uint16_t index, uint8_t *buf, uint16_t len)
+{
+    usbMsgLen_t ret = setup(USB_RECV, request, value, index, len);
+    uint16_t got = 0;
+    uint8_t n;
+
+    if (ret == USB_NO_MSG) {
+        do {
+            n = (len - got < 8) ? len - got : 8;
+            bus_packet(0);
+            n = usbFunctionRead(buf + got, n);
+            got += n;
+        } while (n == 8 && got < len);
+
+    } else {
+        if (ret > len) {
+            ret = len;
+        }
+        while (got < ret) {
+            n = (ret - got < 8) ? ret - got : 8;
+            bus_packet(0);
+            memcpy(buf + got, usbMsgPtr + got, n);
+            got += n;
+        }
+    }
+
+    /* Status stage */
+    bus_packet(1);
+    return got;
+}
+
+/**
+ * Wait for the next message on the interrupt endpoint.
+ *
+ * @return 0 if a message was received into buf, -1 on timeout
+ */
+static int
+intr_in(uint8_t *buf)
+{
+    uint32_t start = sim_time;
+
+    while (sim_time - start < TIMEOUT_US) {
+        sim_yield();
+        sim_time += PACKET_US;
+        if (sim_time < next_intr_poll) {
+            continue;
+        }
+        next_intr_poll = sim_time + INTR_POLL_US;
+        stats.packets++;
+        /* Anything but a NAK means there's a message waiting */
+        if (usbTxLen1 != USBPID_NAK) {
+            memcpy(buf, sim_intr_data, 8);
+            usbTxLen1 = USBPID_NAK;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Calculate the CRC32 the same way the bootloader does.
+ */
+static uint32_t
+crc32(const uint8_t *data, uint16_t len)
+{
+    uint32_t crc = 0xffffffff;
+    uint8_t bit;
+
+    while (len--) {
+        crc ^= *data++;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+    }
+    return ~crc;
+}
+
+/**
+ * Calculate the CRC16 of a chunk in a window, see MEMPAGE_WINDOW in ../main.c.
+ */
+static uint16_t
+crc16(const uint8_t *data, uint16_t len)
+{
+    uint16_t crc = 0;
+    uint8_t bit;
+
+    while (len--) {
+        crc ^= *data++ << 8;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * Compress a single memory page like lzpage.py does, using everything in
+ * front of it as dictionary. The longest match wins, the closest one if
+ * there are several.
+ *
+ * @param out Buffer for the compressed data, at least SPM_PAGESIZE + 3 bytes
+ * @return Compressed size, or 0 if compressing doesn't pay off
+ */
+static uint16_t
+compress_page(uint16_t offset, uint16_t length, uint8_t *out)
+{
+    uint16_t end = offset + length;
+    uint16_t pos = offset;
+    uint16_t size = 0;
+    uint16_t flags_pos = 0;
+    uint8_t item = 8;
+
+    while (pos < end) {
+        uint16_t max_len = (end - pos < LZ_MAX_MATCH) ? end - pos : LZ_MAX_MATCH;
+        uint16_t best_len = 0;
+        uint16_t best_off = 0;
+        uint16_t off;
+
+        if (size >= length) {
+            return 0;
+        }
+        if (item == 8) {
+            flags_pos = size;
+            out[size++] = 0;
+            item = 0;
+        }
+
+        for (off = 1; off <= pos && off <= LZ_MAX_OFFSET && best_len < max_len; off++) {
+            uint16_t n = 0;
+
+            while (n < max_len && image[pos - off + n] == image[pos + n]) {
+                n++;
+            }
+            if (n > best_len) {
+                best_len = n;
+                best_off = off;
+            }
+        }
+
+        if (best_len >= LZ_MIN_MATCH) {
+            out[size++] = (((best_off - 1) >> 4) & 0xf0) | (best_len - LZ_MIN_MATCH);
+            out[size++] = (best_off - 1) & 0xff;
+            pos += best_len;
+        } else {
+            out[flags_pos] |= 1 << item;
+            out[size++] = image[pos++];
+        }
+        item++;
+    }
+    return (size < length) ? size : 0;
+}
+
+/**
+ * Add the data of a memory page to a transfer, compressed if it pays off.
+ *
+ * @return Number of bytes added
+ */
+static uint16_t
+page_data(uint8_t *dest, uint16_t page, uint16_t pages)
+{
+    uint16_t size = (page == pages - 1) ? image_len - page * SPM_PAGESIZE : SPM_PAGESIZE;
+
+    if (packed_len[page] > 0) {
+        memcpy(dest, packed[page], packed_len[page]);
+        return packed_len[page];
+    }
+    memcpy(dest, image + page * SPM_PAGESIZE, size);
+    return size;
+}
+
+/**
+ * Wait for the READY notification of the last transfer, see UsbHandler.waitForReady().
+ *
+ * @return 1 if the reported CRC32 matches the sent data, 0 otherwise
+ */
+static int
+wait_ready(uint16_t offset, uint16_t length, uint16_t last_page)
+{
+    uint8_t msg[8];
+    uint8_t failed = 0;
+
+    while (intr_in(msg) == 0) {
+        uint16_t page = msg[2] | (msg[3] << 8);
+
+        if (msg[0] == NOTIFY_ERROR) {
+            failed = 1;
+        } else if (msg[0] == NOTIFY_READY && (failed || page == last_page)) {
+            uint32_t crc = msg[4] | (msg[5] << 8) | ((uint32_t) msg[6] << 16) | ((uint32_t) msg[7] << 24);
+            return !failed && crc == crc32(image + offset, length);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read back the pages of the last transfer and compare them.
+ *
+ * @return 1 if all pages match, 0 otherwise
+ */
+static int
+read_back(uint16_t offset, uint16_t length)
+{
+    static uint8_t buf[MAX_IMAGE_SIZE];
+
+    return ctrl_in(CMD_FWUPDATE_VERIFY, 0, 0, buf, length) == length &&
+            memcmp(buf, image + offset, length) == 0;
+}
+
+/**
+ * Send a window of memory pages, and resend the chunks that weren't
+ * acknowledged until all of them are, see UsbHandler.flashFirmwareWindow().
+ * Compressed chunks are only acknowledged up to the first missing one.
+ *
+ * @return 1 if all chunks were acknowledged, 0 if giving up
+ */
+static int
+send_window(uint16_t first, uint16_t count, uint16_t window, uint16_t pages, uint16_t mode)
+{
+    static uint8_t transfer[MAX_WINDOW_SIZE * (WINDOW_HEADER_SIZE + SPM_PAGESIZE + WINDOW_CRC_SIZE)];
+    uint16_t pending = (1UL << count) - 1;
+    uint8_t ack[4];
+    int attempt;
+
+    for (attempt = 1; attempt <= MAX_ATTEMPTS; attempt++) {
+        uint16_t size = 0;
+        uint16_t seq;
+
+        for (seq = 0; seq < count; seq++) {
+            uint16_t page = first + seq;
+            uint16_t chunk;
+            uint16_t crc;
+            uint8_t *start = transfer + size;
+
+            if (!(pending & (1U << seq)) || (opt.drop && attempt == 1 && seq == 0)) {
+                continue;
+            }
+            transfer[size++] = seq;
+            transfer[size++] = page & 0xff;
+            transfer[size++] = page >> 8;
+            chunk = page_data(transfer + size + 1, page, pages);
+            transfer[size++] = chunk;
+            size += chunk;
+            crc = crc16(start, transfer + size - start);
+            transfer[size++] = crc >> 8;
+            transfer[size++] = crc & 0xff;
+            if (attempt > 1) {
+                stats.resent++;
+            }
+        }
+
+        ctrl_out(CMD_FWUPDATE_MEMPAGE, mode | MEMPAGE_WINDOW, window, transfer, size);
+        if (ctrl_in(CMD_FWUPDATE_ACK, 0, 0, ack, sizeof(ack)) == sizeof(ack) &&
+                (ack[0] | (ack[1] << 8)) == window)
+        {
+            pending &= ~(ack[2] | (ack[3] << 8));
+        }
+        if (pending == 0) {
+            return 1;
+        }
+        stats.retries++;
+    }
+    return 0;
+}
+
+/**
+ * Send the whole firmware image, from INIT to FINALIZE.
+ *
+ * @param features Feature flags from the capability block
+ * @param per_transfer Number of memory pages to send in one transfer or window
+ * @param windows 1 to send the memory pages in windows, 0 in transfers
+ * @return 1 if the CRC32 of the flashed image matches, 0 if it doesn't,
+ *         -1 if a transfer couldn't be verified at all
+ */
+static int
+update(uint8_t features, uint16_t per_transfer, uint8_t windows)
+{
+    static uint8_t transfer[PAGES_PER_TRANSFER * 16 * (CHUNK_HEADER_SIZE + SPM_PAGESIZE)];
+    uint16_t pages = (image_len + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+    uint16_t window = 0;
+    uint16_t first;
+    uint16_t count;
+    uint32_t crc = crc32(image, image_len);
+    uint8_t buf[4];
+
+    ctrl_out(CMD_FWUPDATE_INIT, pages, image_len, NULL, 0);
+    if ((features & FEATURE_ERASE_AHEAD) && !opt.no_erase) {
+        ctrl_out(CMD_FWUPDATE_ERASE, 0, pages, NULL, 0);
+    }
+
+    for (first = 0; first < pages; first += count) {
+        /* Compressed and raw pages go in separate transfers, the mode is set for all of it */
+        uint16_t mode = (packed_len[first] > 0) ? MEMPAGE_COMPRESSED : MEMPAGE_RAW;
+        uint16_t offset = first * SPM_PAGESIZE;
+        uint16_t length;
+        uint16_t size = 0;
+        uint16_t page;
+        int attempt;
+
+        count = 1;
+        while (first + count < pages && count < per_transfer &&
+                (packed_len[first + count] > 0) == (mode == MEMPAGE_COMPRESSED))
+        {
+            count++;
+        }
+        length = (image_len - offset < count * SPM_PAGESIZE) ? image_len - offset : count * SPM_PAGESIZE;
+
+        if (windows) {
+            if (!send_window(first, count, window++, pages, mode)) {
+                printf("ERROR: giving up on page %u\n", first);
+                return -1;
+            }
+            continue;
+        }
+
+        for (page = first; page < first + count; page++) {
+            uint16_t chunk;
+
+            transfer[size++] = page & 0xff;
+            transfer[size++] = page >> 8;
+            chunk = page_data(transfer + size + 1, page, pages);
+            transfer[size++] = chunk;
+            size += chunk;
+        }
+
+        for (attempt = 1; ; attempt++) {
+            int verified;
+
+            ctrl_out(CMD_FWUPDATE_MEMPAGE, mode, 0, transfer, size);
+            if ((features & FEATURE_NOTIFY) && ENDPOINTS > 0 && !opt.readback) {
+                verified = wait_ready(offset, length, first + count - 1);
+            } else {
+                verified = read_back(offset, length);
+            }
+            if (verified) {
+                break;
+            }
+            if (attempt == MAX_ATTEMPTS) {
+                printf("ERROR: giving up on page %u\n", first);
+                return -1;
+            }
+            stats.retries++;
+        }
+    }
+
+    ctrl_out(CMD_FWUPDATE_FINALIZE, crc & 0xffff, crc >> 16, NULL, 0);
+
+    return ctrl_in(CMD_FWUPDATE_CRC, image_len, 0, buf, sizeof(buf)) == sizeof(buf) &&
+            (buf[0] | (buf[1] << 8) | ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24)) == crc;
+}
+
+/**
+ * Read the timing histograms and print each phase's summary, see timing.py.
+ */
+static void
+print_timing(void)
+{
+    static const char *names[TIMING_PHASES] = { "erase", "write", "receive", "hold" };
+    uint8_t buf[2 + TIMING_PHASES * TIMING_HISTOGRAM_SIZE];
+    uint8_t phase;
+
+    if (ctrl_in(CMD_TIMING, 0, 0, buf, sizeof(buf)) != sizeof(buf) ||
+            buf[0] != TIMING_PHASES || buf[1] != TIMING_BUCKETS)
+    {
+        printf("ERROR: unexpected timing histograms\n");
+        return;
+    }
+
+    for (phase = 0; phase < TIMING_PHASES; phase++) {
+        uint8_t *histogram = buf + 2 + phase * TIMING_HISTOGRAM_SIZE;
+        uint8_t *tail = histogram + TIMING_BUCKETS * 2;
+        uint32_t count = 0;
+        uint16_t max = tail[0] | (tail[1] << 8);
+        uint32_t total = tail[2] | (tail[3] << 8) | ((uint32_t) tail[4] << 16) | ((uint32_t) tail[5] << 24);
+        int i;
+
+        for (i = 0; i < TIMING_BUCKETS; i++) {
+            count += histogram[2 * i] | (histogram[2 * i + 1] << 8);
+        }
+        printf("timing:      %-8s %5u x, mean %6.0f us, max %6.0f us, total %8.0f us\n",
+                names[phase], (unsigned int) count,
+                count ? total * TIMING_TICK_US / count : 0,
+                max * TIMING_TICK_US, total * TIMING_TICK_US);
+    }
+}
+
+/**
+ * Read the event trace and check the pages it saw written, see trace.py.
+ *
+ * @return 1 if all written pages are part of the image, 0 otherwise
+ */
+static int
+check_trace(void)
+{
+    uint8_t buf[2 + TRACE_ENTRIES * TRACE_ENTRY_SIZE];
+    uint16_t pages = (image_len + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+    uint16_t count;
+    unsigned int writes = 0;
+    int i;
+
+    if (ctrl_in(CMD_TRACE, 0, 0, buf, sizeof(buf)) != sizeof(buf)) {
+        printf("ERROR: unexpected trace buffer\n");
+        return 0;
+    }
+    count = buf[0] | (buf[1] << 8);
+
+    for (i = 0; i < count && i < TRACE_ENTRIES; i++) {
+        uint8_t *entry = buf + 2 + i * TRACE_ENTRY_SIZE;
+        uint16_t page = entry[1] | (entry[2] << 8);
+
+        if (entry[0] != TRACE_WRITE_END) {
+            continue;
+        }
+        if (page >= pages) {
+            printf("ERROR: trace has page %u written, image has %u pages\n", page, pages);
+            return 0;
+        }
+        writes++;
+    }
+    printf("trace:       %u events, %u page writes in the last %u\n",
+            count, writes, (count < TRACE_ENTRIES) ? count : TRACE_ENTRIES);
+    return 1;
+}
+
+/**
+ * Write a few bytes to EEPROM and read them back, like config.py does,
+ * retrying until they match, as nothing else verifies EEPROM writes.
+ * Also try writing the application record, which has to be ignored.
+ *
+ * @return 1 if all went as expected, 0 otherwise
+ */
+static int
+eeprom_test(void)
+{
+    uint8_t data[EEPROM_TEST_SIZE];
+    uint8_t buf[EEPROM_TEST_SIZE];
+    uint8_t record[4];
+    int attempt;
+    int i;
+
+    for (i = 0; i < EEPROM_TEST_SIZE; i++) {
+        data[i] = rand();
+    }
+    for (attempt = 1; attempt <= MAX_ATTEMPTS; attempt++) {
+        ctrl_out(CMD_EEPROM_WRITE, 0, 0, data, sizeof(data));
+        if (ctrl_in(CMD_EEPROM_READ, 0, 0, buf, sizeof(buf)) == sizeof(buf) &&
+                memcmp(buf, data, sizeof(data)) == 0)
+        {
+            break;
+        }
+        stats.retries++;
+    }
+    if (attempt > MAX_ATTEMPTS) {
+        printf("ERROR: EEPROM data not written\n");
+        return 0;
+    }
+
+    memcpy(record, sim_eeprom + APP_RECORD_ADDR, sizeof(record));
+    ctrl_out(CMD_EEPROM_WRITE, APP_RECORD_ADDR, 0, data, sizeof(record));
+    if (memcmp(record, sim_eeprom + APP_RECORD_ADDR, sizeof(record)) != 0) {
+        printf("ERROR: EEPROM write into the reserved area\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Host side of the update session, running as coroutine.
+ */
+static void
+session(void)
+{
+    uint8_t reply[128] = { 0 };
+    uint8_t *caps;
+    uint8_t features;
+    uint8_t features_ext = 0;
+    uint16_t per_transfer = PAGES_PER_TRANSFER;
+    uint8_t windows = 0;
+    int ret = 0;
+    int i;
+
+    ctrl_in(CMD_HELLO, HELLO_VALUE, HELLO_INDEX, reply, sizeof(reply) - 1);
+    printf("banner:      %s\n", reply);
+    caps = reply + strlen((char *) reply) + 1;
+    if (caps[0] < CAPS_MIN_SIZE) {
+        printf("ERROR: no capability block\n");
+        return;
+    }
+
+    features = caps[CAPS_FEATURES];
+    if (caps[0] > CAPS_FEATURES_EXT) {
+        features_ext = caps[CAPS_FEATURES_EXT];
+    }
+    stats.wear = (features_ext & FEATURE_EXT_WEAR) != 0;
+    if ((features & FEATURE_NOTIFY) && ENDPOINTS == 0) {
+        printf("ERROR: notifications without interrupt endpoint\n");
+        return;
+    }
+    printf("verify:      %s\n", ((features & FEATURE_NOTIFY) && !opt.readback)
+            ? "notifications" : "read back");
+    if ((caps[CAPS_PAGE_SIZE] | (caps[CAPS_PAGE_SIZE + 1] << 8)) != SPM_PAGESIZE) {
+        printf("ERROR: unexpected page size\n");
+        return;
+    }
+    if (image_len > (caps[CAPS_APP_SIZE] | (caps[CAPS_APP_SIZE + 1] << 8))) {
+        printf("ERROR: image too big\n");
+        return;
+    }
+    if (caps[0] > CAPS_WINDOW_SIZE && caps[CAPS_PROTOCOL] >= PROTOCOL_WINDOW &&
+            caps[CAPS_WINDOW_SIZE] > 0 && !opt.no_window)
+    {
+        windows = 1;
+        per_transfer = (caps[CAPS_WINDOW_SIZE] < MAX_WINDOW_SIZE)
+                     ? caps[CAPS_WINDOW_SIZE] : MAX_WINDOW_SIZE;
+    }
+    if (opt.pages_per_transfer > 0 && (!windows || opt.pages_per_transfer < per_transfer)) {
+        per_transfer = opt.pages_per_transfer;
+    }
+    if (!(features & FEATURE_MULTI_PAGE)) {
+        per_transfer = 1;
+    }
+    if (per_transfer * (CHUNK_HEADER_SIZE + SPM_PAGESIZE) >
+            (caps[CAPS_MAX_TRANSFER] | (caps[CAPS_MAX_TRANSFER + 1] << 8)))
+    {
+        per_transfer = (caps[CAPS_MAX_TRANSFER] | (caps[CAPS_MAX_TRANSFER + 1] << 8)) /
+                (CHUNK_HEADER_SIZE + SPM_PAGESIZE);
+    }
+
+    if ((features & FEATURE_EEPROM) && !eeprom_test()) {
+        return;
+    }
+
+    memset(packed_len, 0, sizeof(packed_len));
+    if ((features & FEATURE_COMPRESSION) && opt.compress) {
+        for (i = 0; i * SPM_PAGESIZE < image_len; i++) {
+            uint16_t offset = i * SPM_PAGESIZE;
+            uint16_t length = (image_len - offset < SPM_PAGESIZE) ? image_len - offset : SPM_PAGESIZE;
+
+            packed_len[i] = compress_page(offset, length, packed[i]);
+            if (packed_len[i] > 0) {
+                stats.compressed++;
+                stats.packed_bytes += packed_len[i];
+            } else {
+                stats.packed_bytes += length;
+            }
+        }
+    }
+
+    stats.update_start = sim_time;
+    for (i = 0; i < MAX_UPDATES && ret == 0; i++) {
+        ret = update(features, per_transfer, windows);
+        if (ret == 0) {
+            stats.restarts++;
+        }
+    }
+    stats.update_end = sim_time;
+
+    if (ret != 1) {
+        printf("ERROR: CRC32 mismatch\n");
+        return;
+    }
+    if (features_ext & FEATURE_EXT_TIMING) {
+        print_timing();
+    }
+    if ((features & FEATURE_TRACE) && !check_trace()) {
+        return;
+    }
+
+    ctrl_out(CMD_BYE, 0, 0, NULL, 0);
+    ctrl_out(CMD_RESET, 0, 0, NULL, 0);
+    stats.ok = 1;
+
+    /* Give the bootloader time to reset */
+    for (i = 0; i < 100; i++) {
+        sim_yield();
+    }
+}
+
+/**
+ * Host side of the second boot, nothing to do there.
+ */
+static void
+idle(void)
+{
+}
+
+/**
+ * Host side of a boot with the enable pin held, but no host talking to
+ * the bootloader. Waits a second longer than the idle timeout.
+ */
+static void
+idle_wait(void)
+{
+    uint32_t start = sim_time;
+
+    while (sim_time - start < (IDLE_TIMEOUT + 1) * 1000000UL) {
+        sim_yield();
+        sim_time += PACKET_US;
+    }
+}
+
+/**
+ * Fill the image with random data of the given size.
+ *
+ * For compression, most of it is made of repeats of data from the last
+ * couple hundred bytes, so most pages refer back to the previous one.
+ * Every fourth page stays plain random data, and is sent raw.
+ */
+static void
+random_image(unsigned int size)
+{
+    unsigned int i = 0;
+
+    image_len = size;
+    while (i < size) {
+        if (opt.compress && i >= LZ_MAX_MATCH && (i / SPM_PAGESIZE) % 4 != 3 && rand() % 4 != 0) {
+            unsigned int len = LZ_MIN_MATCH + rand() % (LZ_MAX_MATCH - LZ_MIN_MATCH + 1);
+            unsigned int from = i - 1 - rand() % ((i < 256) ? i : 256);
+
+            while (len-- > 0 && i < size) {
+                image[i++] = image[from++];
+            }
+        } else {
+            image[i++] = rand();
+        }
+    }
+}
+
+/**
+ * Load the firmware image from the given file.
+ */
+static void
+load_image(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    image_len = fread(image, 1, sizeof(image), file);
+    if (!feof(file)) {
+        fprintf(stderr, "%s: image too big\n", filename);
+        exit(1);
+    }
+    fclose(file);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-l <loss %%>] [-c <corrupt %%>] [-n <pages>] [-s <seed>]\n"
+                    "          [-r <size>] [-z] [-d] [-W] [-V] [-E] [-i] [-v] [<firmware.bin>]\n", name);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int random_size = 0;
+    uint32_t update_us;
+    uint32_t wear = 0;
+    uint8_t wear_ok = 1;
+    int ret;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "l:c:n:s:r:zdWVEiv")) != -1) {
+        switch (c) {
+            case 'l': opt.loss = atof(optarg); break;
+            case 'c': opt.corrupt = atof(optarg); break;
+            case 'n': opt.pages_per_transfer = atoi(optarg); break;
+            case 's': opt.seed = atoi(optarg); break;
+            case 'r': random_size = atoi(optarg); break;
+            case 'z': opt.compress = 1; break;
+            case 'd': opt.drop = 1; break;
+            case 'W': opt.no_window = 1; break;
+            case 'V': opt.readback = 1; break;
+            case 'E': opt.no_erase = 1; break;
+            case 'i': opt.idle = 1; break;
+            case 'v': sim_verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (opt.pages_per_transfer > 16 * PAGES_PER_TRANSFER ||
+            random_size > MAX_IMAGE_SIZE || (optind < argc) == (random_size > 0))
+    {
+        usage(argv[0]);
+    }
+
+    srand(opt.seed);
+    if (random_size > 0) {
+        random_image(random_size);
+    } else {
+        load_image(argv[optind]);
+    }
+
+    sim_init();
+    ret = sim_run(session);
+    update_us = stats.update_end - stats.update_start;
+
+    printf("image:       %u bytes\n", image_len);
+    printf("session:     %s, %s\n", stats.ok ? "completed" : "FAILED",
+            (ret == SIM_EXIT_RESET) ? "device reset" : "device didn't reset");
+    printf("total time:  %u.%03u ms\n", sim_time / 1000, sim_time % 1000);
+    printf("update time: %u.%03u ms, INIT to FINALIZE\n", update_us / 1000, update_us % 1000);
+    if (update_us > 0) {
+        printf("throughput:  %.0f bytes/s\n", image_len * 1e6 / update_us);
+    }
+    printf("packets:     %u sent, %u lost, %u corrupted, %u NAKed\n",
+            stats.packets, stats.lost, stats.corrupted, stats.naks);
+    printf("retries:     %u transfers, %u chunks resent, %u whole updates\n",
+            stats.retries, stats.resent, stats.restarts);
+    if (stats.compressed > 0) {
+        printf("compressed:  %u pages, %u bytes sent\n", stats.compressed, stats.packed_bytes);
+    }
+    printf("flash:       %u pages erased, %u pages written\n", sim_erases, sim_writes);
+    printf("violations:  %u\n", sim_violations);
+
+    /*
+     * Each counter has to be somewhere between the erases of the most worn
+     * page of its block and the erases of all its pages. A block counted
+     * again before its counter was updated is only counted once though,
+     * which happens with retries. Without those, each block was written by
+     * a single update, so it's counted once exactly if it was erased.
+     */
+    for (i = 0; i < WEAR_COUNTERS; i++) {
+        uint16_t counter = ~(sim_eeprom[WEAR_ADDR + 2 * i] | (sim_eeprom[WEAR_ADDR + 2 * i + 1] << 8));
+        unsigned int erases = 0;
+        unsigned int most = 0;
+        int page;
+
+        for (page = i * WEAR_BLOCK_PAGES; page < (i + 1) * WEAR_BLOCK_PAGES; page++) {
+            erases += sim_page_erases[page];
+            if (sim_page_erases[page] > most) {
+                most = sim_page_erases[page];
+            }
+        }
+        if (counter > erases || (erases > 0 && counter == 0) ||
+                (counter != (most > 0) && stats.retries == 0 && stats.restarts == 0))
+        {
+            wear_ok = 0;
+        }
+        wear += counter;
+    }
+    printf("wear:        %u block erases counted\n", (unsigned int) wear);
+
+    if (!stats.ok || ret != SIM_EXIT_RESET) {
+        return 1;
+    }
+    if (memcmp(sim_flash, image, image_len) != 0) {
+        printf("ERROR: flash memory doesn't match the image\n");
+        return 1;
+    }
+    if (sim_eeprom[APP_RECORD_ADDR] != APP_STATE_VALID) {
+        printf("ERROR: application record not valid\n");
+        return 1;
+    }
+    if (stats.wear && !wear_ok) {
+        printf("ERROR: wear counters don't match the erased pages\n");
+        return 1;
+    }
+
+    /* Boot again with the enable pin released, the application should start */
+    PINB = 0x01;
+    if (sim_run(idle) != SIM_EXIT_APP) {
+        printf("ERROR: application not started after reset\n");
+        return 1;
+    }
+
+    if (opt.idle) {
+        /* Boot with the enable pin held, the idle timeout has to start the application */
+        uint32_t start = sim_time;
+
+        PINB = 0x00;
+        if (sim_run(idle_wait) != SIM_EXIT_RESET) {
+            printf("ERROR: no idle timeout\n");
+            return 1;
+        }
+        printf("idle:        timeout after %u ms\n", (sim_time - start) / 1000);
+        if (sim_run(idle) != SIM_EXIT_APP) {
+            printf("ERROR: application not started after idle timeout\n");
+            return 1;
+        }
+    }
+
+    return (sim_violations > 0);
+}
@@ -0,0 +1,50 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _SIM_AVR_BOOT_H_
+#define _SIM_AVR_BOOT_H_
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/*
+ * Self-programming functions, backed by the simulated flash memory in
+ * sim.c. Erasing and writing a page keeps the SPM busy for the time the
+ * datasheet states, and the RWW section can't be read until it's enabled
+ * again afterwards. Busy waiting skips the simulated time ahead.
+ */
+void sim_page_erase(uint16_t address);
+void sim_page_fill(uint16_t address, uint16_t word);
+void sim_page_write(uint16_t address);
+void sim_rww_enable(void);
+uint8_t sim_spm_busy(void);
+void sim_spm_busy_wait(void);
+
+#define boot_page_erase(address)        sim_page_erase(address)
+#define boot_page_fill(address, word)   sim_page_fill(address, word)
+#define boot_page_write(address)        sim_page_write(address)
+#define boot_rww_enable()               sim_rww_enable()
+#define boot_spm_busy()                 sim_spm_busy()
+#define boot_spm_busy_wait()            sim_spm_busy_wait()
+#define boot_rww_enable_safe()          do { sim_spm_busy_wait(); sim_rww_enable(); } while (0)
+
+#endif /* _SIM_AVR_BOOT_H_ */
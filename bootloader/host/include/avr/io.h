@@ -0,0 +1,77 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _SIM_AVR_IO_H_
+#define _SIM_AVR_IO_H_
+#include <stdint.h>
+
+/*
+ * Minimal ATmega328P I/O register set for the host simulation.
+ *
+ * Registers are plain memory at their data space addresses, so whatever
+ * gets written to them just stays there, and the simulation can set up
+ * input pins and flags by writing to them as well.
+ */
+
+/** Register file, indexed by the registers' data space address */
+extern volatile uint8_t sim_regs[0x100];
+/** Topmost word in RAM, where the boot key is passed across resets */
+extern volatile uint16_t sim_boot_key;
+
+/** Timer1 counter, derived from the simulated time */
+uint16_t sim_timer1(void);
+
+#define _BV(bit) (1 << (bit))
+
+#define PINB    sim_regs[0x23]
+#define DDRB    sim_regs[0x24]
+#define PORTB   sim_regs[0x25]
+#define TIFR0   sim_regs[0x35]
+#define TCCR0A  sim_regs[0x44]
+#define TCCR0B  sim_regs[0x45]
+#define TCNT0   sim_regs[0x46]
+#define MCUSR   sim_regs[0x54]
+#define MCUCR   sim_regs[0x55]
+#define SREG    sim_regs[0x5f]
+#define TCCR1A  sim_regs[0x80]
+#define TCCR1B  sim_regs[0x81]
+#define TCNT1   sim_timer1()
+
+#define TOV0    0
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define CS12    2
+#define WDRF    3
+#define IVCE    0
+#define IVSEL   1
+#define SREG_I  7
+
+#define SPM_PAGESIZE    128
+/* Only used for the boot key address, i.e. RAMEND - 1 */
+#define RAMEND          ((uintptr_t) &sim_boot_key + 1)
+#define E2END           0x3ff
+#define FLASHEND        0x7fff
+#define _VECTORS_SIZE   (26 * 4)
+
+#endif /* _SIM_AVR_IO_H_ */
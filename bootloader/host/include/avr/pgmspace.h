@@ -0,0 +1,54 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _SIM_AVR_PGMSPACE_H_
+#define _SIM_AVR_PGMSPACE_H_
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Program memory access, reading from the simulated flash memory.
+ * Addresses are 16-bit flash addresses disguised as pointers, as usual.
+ */
+uint8_t sim_flash_read(uint16_t address);
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define sim_pgm_addr(p) ((uint16_t) (uintptr_t) (p))
+#define pgm_read_byte(p) sim_flash_read(sim_pgm_addr(p))
+#define pgm_read_word(p) ((uint16_t) (pgm_read_byte(p) | (pgm_read_byte(sim_pgm_addr(p) + 1) << 8)))
+#define pgm_read_dword(p) ((uint32_t) pgm_read_word(p) | ((uint32_t) pgm_read_word(sim_pgm_addr(p) + 2) << 16))
+
+static inline void *
+memcpy_P(void *dest, const void *src, size_t n)
+{
+    uint8_t *d = dest;
+    while (n--) {
+        *d++ = pgm_read_byte(src);
+        src = (const uint8_t *) src + 1;
+    }
+    return dest;
+}
+
+#endif /* _SIM_AVR_PGMSPACE_H_ */
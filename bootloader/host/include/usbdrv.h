@@ -0,0 +1,87 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __usbdrv_h_included__
+#define __usbdrv_h_included__
+#include <stdint.h>
+#include "usbconfig.h"
+
+/*
+ * Mock V-USB driver interface.
+ *
+ * This is force-included before the bootloader sources, so it takes the
+ * place of the real usbdrv/usbdrv.h (same include guard). It only has
+ * what the bootloader uses, and sim.c together with the simulated host
+ * in harness.c implement the driver side of it.
+ */
+typedef unsigned char uchar;
+typedef signed char schar;
+
+#if USB_CFG_LONG_TRANSFERS
+typedef uint16_t usbMsgLen_t;
+#else
+typedef uint8_t usbMsgLen_t;
+#endif
+typedef uchar *usbMsgPtr_t;
+
+#define USB_NO_MSG ((usbMsgLen_t) -1)
+#define USBPID_NAK 0x5a
+
+typedef union usbWord {
+    uint16_t word;
+    uchar bytes[2];
+} usbWord_t;
+
+typedef struct usbRequest {
+    uchar bmRequestType;
+    uchar bRequest;
+    usbWord_t wValue;
+    usbWord_t wIndex;
+    usbWord_t wLength;
+} usbRequest_t;
+
+extern usbMsgPtr_t usbMsgPtr;
+extern volatile uchar usbTxLen1;
+extern volatile schar usbRxLen;
+
+void usbInit(void);
+void usbPoll(void);
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+/* Only there with an interrupt-IN endpoint, just like in the real driver */
+void usbSetInterrupt(uchar *data, uchar len);
+#define usbInterruptIsReady()       (usbTxLen1 & 0x10)
+#endif
+
+usbMsgLen_t usbFunctionSetup(uchar data[8]);
+uchar usbFunctionWrite(uchar *data, uchar len);
+uchar usbFunctionRead(uchar *data, uchar len);
+
+#if USB_CFG_HAVE_FLOWCONTROL
+#define usbDisableAllRequests()     usbRxLen = -1
+#define usbEnableAllRequests()      usbRxLen = 0
+#define usbAllRequestsAreDisabled() (usbRxLen < 0)
+#endif
+#define usbDeviceConnect()
+#define usbDeviceDisconnect()
+
+#endif /* __usbdrv_h_included__ */
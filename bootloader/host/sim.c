@@ -0,0 +1,493 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include "uart.h"
+#include "light_ws2812.h"
+#include "usbdrv.h"
+#include "sim.h"
+
+/** Maximum number of violations printed, they tend to come in bulk */
+#define MAX_PRINTED_VIOLATIONS 10
+/** Stack size of the host coroutine */
+#define HOST_STACK_SIZE (256 * 1024)
+
+volatile uint8_t sim_regs[0x100];
+volatile uint16_t sim_boot_key;
+uint32_t sim_time;
+uint8_t sim_flash[FLASHEND + 1];
+uint8_t sim_eeprom[E2END + 1];
+uint16_t sim_erases;
+uint16_t sim_page_erases[(FLASHEND + 1) / SPM_PAGESIZE];
+uint16_t sim_writes;
+uint16_t sim_violations;
+uint8_t sim_verbose;
+uint8_t sim_intr_data[8];
+
+usbMsgPtr_t usbMsgPtr;
+volatile uchar usbTxLen1;
+volatile schar usbRxLen;
+
+/** Temporary page buffer filled via boot_page_fill() */
+static uint8_t page_buffer[SPM_PAGESIZE];
+/** Simulated time when the ongoing SPM operation is done */
+static uint32_t spm_busy_until;
+/** Flag if the RWW section is disabled after an erase or write */
+static uint8_t rww_disabled;
+/** Number of Timer0 overflows when last checked */
+static uint32_t timer0_overflows;
+
+/*
+ * The bootloader's initialized and zeroed variables, see the Makefile,
+ * along with a copy of the initial values.
+ */
+extern uint8_t __start_sim_data[];
+extern uint8_t __stop_sim_data[];
+extern uint8_t __start_sim_bss[];
+extern uint8_t __stop_sim_bss[];
+static uint8_t *sim_data_init;
+
+/** Context to return to once the bootloader stops */
+static jmp_buf exit_env;
+/** Bootloader context, i.e. the caller's stack */
+static ucontext_t device_ctx;
+/** Host coroutine context */
+static ucontext_t host_ctx;
+/** Host function running in the coroutine */
+static void (*host_func)(void);
+/** Flag if the host function has returned */
+static uint8_t host_done;
+
+
+/**
+ * Report a violation of the self-programming rules.
+ */
+static void
+violation(const char *fmt, ...)
+{
+    va_list args;
+
+    if (++sim_violations > MAX_PRINTED_VIOLATIONS) {
+        return;
+    }
+
+    fprintf(stderr, "VIOLATION at %u.%03ums: ", sim_time / 1000, sim_time % 1000);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+/**
+ * Check an SPM operation can be started on the given address.
+ */
+static void
+check_spm(const char *op, uint16_t address)
+{
+    if (sim_time < spm_busy_until) {
+        violation("%s 0x%04x while SPM is busy", op, address);
+    }
+    if (address >= BOOTLOAD_ADDR) {
+        violation("%s 0x%04x inside the bootloader section", op, address);
+    }
+}
+
+void
+sim_page_erase(uint16_t address)
+{
+    address &= ~(SPM_PAGESIZE - 1);
+    check_spm("erase", address);
+    memset(&sim_flash[address], 0xff, SPM_PAGESIZE);
+    spm_busy_until = sim_time + SIM_ERASE_US;
+    rww_disabled = 1;
+    sim_erases++;
+    sim_page_erases[address / SPM_PAGESIZE]++;
+}
+
+void
+sim_page_fill(uint16_t address, uint16_t word)
+{
+    if (sim_time < spm_busy_until) {
+        violation("fill 0x%04x while SPM is busy", address);
+    }
+    address &= SPM_PAGESIZE - 1;
+    page_buffer[address] = word & 0xff;
+    page_buffer[address + 1] = word >> 8;
+}
+
+void
+sim_page_write(uint16_t address)
+{
+    uint8_t i;
+
+    address &= ~(SPM_PAGESIZE - 1);
+    check_spm("write", address);
+    /* Programming can only clear bits, so a missing erase shows */
+    for (i = 0; i < SPM_PAGESIZE; i++) {
+        sim_flash[address + i] &= page_buffer[i];
+    }
+    memset(page_buffer, 0xff, sizeof(page_buffer));
+    spm_busy_until = sim_time + SIM_WRITE_US;
+    rww_disabled = 1;
+    sim_writes++;
+}
+
+void
+sim_rww_enable(void)
+{
+    if (sim_time < spm_busy_until) {
+        violation("RWW enable while SPM is busy");
+        return;
+    }
+    rww_disabled = 0;
+}
+
+uint8_t
+sim_spm_busy(void)
+{
+    return sim_time < spm_busy_until;
+}
+
+void
+sim_spm_busy_wait(void)
+{
+    if (sim_time < spm_busy_until) {
+        sim_time = spm_busy_until;
+    }
+}
+
+uint8_t
+sim_flash_read(uint16_t address)
+{
+    if (address > FLASHEND) {
+        violation("read 0x%04x beyond flash memory", address);
+        return 0xff;
+    }
+    if (address < BOOTLOAD_ADDR && rww_disabled) {
+        violation("read 0x%04x while RWW section is disabled", address);
+        return 0xff;
+    }
+    return sim_flash[address];
+}
+
+
+/** Get the EEPROM array index of the given EEPROM address pointer */
+#define ee(address) ((uintptr_t) (address) & E2END)
+
+uint8_t
+eeprom_read_byte(const uint8_t *address)
+{
+    return sim_eeprom[ee(address)];
+}
+
+uint16_t
+eeprom_read_word(const uint16_t *address)
+{
+    uint16_t value;
+    eeprom_read_block(&value, address, sizeof(value));
+    return value;
+}
+
+uint32_t
+eeprom_read_dword(const uint32_t *address)
+{
+    uint32_t value;
+    eeprom_read_block(&value, address, sizeof(value));
+    return value;
+}
+
+void
+eeprom_read_block(void *dest, const void *src, size_t n)
+{
+    uint8_t *d = dest;
+    while (n--) {
+        *d++ = sim_eeprom[ee(src)];
+        src = (const uint8_t *) src + 1;
+    }
+}
+
+void
+eeprom_update_byte(uint8_t *address, uint8_t value)
+{
+    sim_eeprom[ee(address)] = value;
+}
+
+void
+eeprom_update_word(uint16_t *address, uint16_t value)
+{
+    eeprom_update_block(&value, address, sizeof(value));
+}
+
+void
+eeprom_update_dword(uint32_t *address, uint32_t value)
+{
+    eeprom_update_block(&value, address, sizeof(value));
+}
+
+void
+eeprom_update_block(const void *src, void *dest, size_t n)
+{
+    const uint8_t *s = src;
+    while (n--) {
+        sim_eeprom[ee(dest)] = *s++;
+        dest = (uint8_t *) dest + 1;
+    }
+}
+
+
+void
+uart_init(int16_t brate __attribute__((unused)))
+{
+}
+
+void
+uart_putchar(char data)
+{
+    if (sim_verbose) {
+        fputc(data, stderr);
+    }
+}
+
+void
+uart_poll(void)
+{
+}
+
+void
+uart_flush(void)
+{
+}
+
+uint16_t
+uart_overflows(void)
+{
+    return 0;
+}
+
+/*
+ * Only declared in uart.h for bootloader builds with -DDEBUG
+ */
+void uart_puthex(char data);
+void uart_putint(int32_t number, int8_t digits);
+
+void
+uart_puthex(char data)
+{
+    char buf[3];
+
+    snprintf(buf, sizeof(buf), "%02X", (uint8_t) data);
+    uart_print(buf);
+}
+
+void
+uart_putint(int32_t number, int8_t digits)
+{
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "%0*d", digits, (int) number);
+    uart_print(buf);
+}
+
+void
+uart_newline(void)
+{
+    uart_print("\r\n");
+}
+
+void
+uart_print(char *data)
+{
+    while (*data) {
+        uart_putchar(*data++);
+    }
+}
+
+void
+ws2812_sendarray(uint8_t *array __attribute__((unused)), uint16_t length __attribute__((unused)))
+{
+}
+
+
+void
+sim_delay_us(uint32_t us)
+{
+    sim_time += us;
+}
+
+uint16_t
+sim_timer1(void)
+{
+    /* Timer1 only ever runs at clk/256 */
+    if (!(TCCR1B & (1 << CS12))) {
+        return 0;
+    }
+    return (uint64_t) sim_time * (F_CPU / 1000000) / 256;
+}
+
+/**
+ * Set Timer0's overflow flag if it overflowed since the last check, and
+ * clear it otherwise. Timer0 only ever runs at clk/1024 as the bootloader's
+ * idle timer, which polls and clears the flag right after usbPoll(), but
+ * clearing it by writing a one can't be simulated with plain memory.
+ */
+static void
+timer0_update(void)
+{
+    uint32_t overflows = (uint64_t) sim_time * (F_CPU / 1000000) / 1024 / 256;
+
+    if ((TCCR0B & (1 << CS00)) && overflows != timer0_overflows) {
+        TIFR0 = (1 << TOV0);
+    } else {
+        TIFR0 = 0;
+    }
+    timer0_overflows = overflows;
+}
+
+void
+sim_reset(void)
+{
+    MCUSR |= (1 << WDRF);
+    longjmp(exit_env, SIM_EXIT_RESET);
+}
+
+void
+sim_jump_app(void)
+{
+    longjmp(exit_env, SIM_EXIT_APP);
+}
+
+
+void
+usbInit(void)
+{
+    usbTxLen1 = USBPID_NAK;
+    usbRxLen = 0;
+}
+
+/**
+ * Hand over to the host for one packet, or stop if it's done.
+ */
+void
+usbPoll(void)
+{
+    if (host_done) {
+        longjmp(exit_env, SIM_EXIT_DONE);
+    }
+    swapcontext(&device_ctx, &host_ctx);
+    timer0_update();
+}
+
+void
+usbSetInterrupt(uchar *data, uchar len)
+{
+    if (!usbInterruptIsReady()) {
+        violation("interrupt data set while previous one is pending");
+    }
+    memcpy(sim_intr_data, data, len);
+    usbTxLen1 = len;
+}
+
+
+void
+sim_yield(void)
+{
+    swapcontext(&host_ctx, &device_ctx);
+}
+
+/**
+ * Coroutine entry point, runs the host function and then waits to be
+ * stopped by the bootloader's next usbPoll() call.
+ */
+static void
+host_entry(void)
+{
+    host_func();
+    host_done = 1;
+    while (1) {
+        sim_yield();
+    }
+}
+
+void
+sim_init(void)
+{
+    if (sim_data_init == NULL) {
+        if ((sim_data_init = malloc(__stop_sim_data - __start_sim_data)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(sim_data_init, __start_sim_data, __stop_sim_data - __start_sim_data);
+    }
+    memset((void *) sim_regs, 0, sizeof(sim_regs));
+    sim_boot_key = 0;
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+    memset(sim_eeprom, 0xff, sizeof(sim_eeprom));
+    memset(page_buffer, 0xff, sizeof(page_buffer));
+    sim_time = 0;
+    sim_erases = 0;
+    memset(sim_page_erases, 0, sizeof(sim_page_erases));
+    sim_writes = 0;
+    sim_violations = 0;
+    spm_busy_until = 0;
+    rww_disabled = 0;
+    timer0_overflows = 0;
+}
+
+int
+sim_run(void (*host)(void))
+{
+    static uint8_t *stack;
+    int ret;
+
+    if (stack == NULL && (stack = malloc(HOST_STACK_SIZE)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    host_func = host;
+    host_done = 0;
+    getcontext(&host_ctx);
+    host_ctx.uc_stack.ss_sp = stack;
+    host_ctx.uc_stack.ss_size = HOST_STACK_SIZE;
+    host_ctx.uc_link = NULL;
+    makecontext(&host_ctx, host_entry, 0);
+
+    /* Same as the startup code, .noinit is left alone */
+    memcpy(__start_sim_data, sim_data_init, __stop_sim_data - __start_sim_data);
+    memset(__start_sim_bss, 0, __stop_sim_bss - __start_sim_bss);
+
+    ret = setjmp(exit_env);
+    if (ret == 0) {
+        wdt_init();
+        bootloader_main();
+    }
+    return ret;
+}
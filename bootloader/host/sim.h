@@ -0,0 +1,109 @@
+/*
+ * Ledmacher Bootloader - Host Simulation
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _SIM_H_
+#define _SIM_H_
+#include <stdint.h>
+#include <avr/io.h>
+
+/*
+ * Host simulation of the bootloader's hardware
+ *
+ * The bootloader's main.c is compiled for the host against the mock AVR
+ * and V-USB headers in include/, with main() renamed to bootloader_main().
+ * sim.c provides the hardware behind them: flash memory with page buffer,
+ * SPM busy times and RWW section rules, EEPROM, I/O registers, and the
+ * driver side of V-USB.
+ *
+ * Time is simulated as well. Delays and SPM busy waits advance it, and
+ * so does the simulated host for each USB packet it sends or receives.
+ * The host runs as coroutine next to the bootloader: each time the
+ * bootloader calls usbPoll(), the host gets to transfer one packet,
+ * just like V-USB hands over one received packet per usbPoll() call.
+ */
+
+/** Time it takes to erase a flash memory page in microseconds, tWD_FLASH from the datasheet */
+#define SIM_ERASE_US 4500
+/** Time it takes to write a flash memory page in microseconds, tWD_FLASH from the datasheet */
+#define SIM_WRITE_US 4500
+
+/** Bootloader reset the device */
+#define SIM_EXIT_RESET  1
+/** Bootloader jumped to the application */
+#define SIM_EXIT_APP    2
+/** Host is done, but the bootloader is still running */
+#define SIM_EXIT_DONE   3
+
+/** Simulated time in microseconds */
+extern uint32_t sim_time;
+/** Simulated flash memory */
+extern uint8_t sim_flash[FLASHEND + 1];
+/** Simulated EEPROM */
+extern uint8_t sim_eeprom[E2END + 1];
+/** Number of flash memory pages erased so far */
+extern uint16_t sim_erases;
+/** Number of times each flash memory page was erased so far */
+extern uint16_t sim_page_erases[(FLASHEND + 1) / SPM_PAGESIZE];
+/** Number of flash memory pages written so far */
+extern uint16_t sim_writes;
+/** Number of times the bootloader broke the self-programming rules */
+extern uint16_t sim_violations;
+/** Flag to print the bootloader's UART output to stderr */
+extern uint8_t sim_verbose;
+
+/** Data of the last message passed to usbSetInterrupt() */
+extern uint8_t sim_intr_data[8];
+
+/**
+ * Reset the simulated hardware to its power-up state.
+ * Flash memory and EEPROM are erased, and the bootloader enable pin is
+ * pulled low, so the bootloader stays active.
+ */
+void sim_init(void);
+
+/**
+ * Run the bootloader along with the given host function as coroutine.
+ * Each run is a new boot, with the bootloader's variables set up again,
+ * while flash memory, EEPROM and the I/O registers keep their content.
+ *
+ * @param host Function running the host side, see sim_yield()
+ * @return Reason the bootloader stopped, one of the SIM_EXIT_* values
+ */
+int sim_run(void (*host)(void));
+
+/**
+ * Let the bootloader run until it calls usbPoll() next time.
+ * Called from the host function only.
+ */
+void sim_yield(void);
+
+/** Bootloader's startup code, run before main() just like from .init3 */
+void wdt_init(void);
+
+/** Bootloader's main(), renamed */
+int bootloader_main(void);
+
+/** Replaces the bootloader's jump to the application */
+void sim_jump_app(void);
+
+#endif /* _SIM_H_ */
@@ -23,14 +23,18 @@
  */
 #include <string.h>
 #include <avr/boot.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 #include "uart.h"
 #include "usbconfig.h"
 #include "usbdrv/usbdrv.h"
 #include "light_ws2812.h"
+#include "trace.h"
+#include "timing.h"
 
 /*
  * The Ledmacher Bootloader
@@ -48,8 +52,20 @@
  * cable, applying power otherwise to the device, or triggering a
  * regular reset.
  *
+ * Alternatively, the application can request the bootloader itself by
+ * writing BOOT_KEY to the topmost word in RAM and triggering a watchdog
+ * reset. The bootloader checks for that key before anything else gets a
+ * chance to overwrite it, so remote updates don't require anyone to be
+ * around pressing a button (see enter_bootloader() in device/main.c).
+ *
  * An activated bootloader is indicated by a single dimly lit LED.
  *
+ * Besides flashing new firmware, the bootloader can read and write the
+ * EEPROM, so the application's runtime configuration can be updated on
+ * its own (see config_load() in device/main.c). The application owns
+ * all of the EEPROM except for the last EEPROM_RESERVED bytes, which
+ * are reserved for the bootloader itself and can't be written via USB.
+ *
  *
  * Note, the bootloader can be compiled with extra debug information.
  *
@@ -57,6 +73,9 @@
  * mainly just a banner, the bootloader enable pin state, and whichever
  * command was received. If you're not planning on developing on the
  * bootloader itself, this should be fine (assuming use UART at all).
+ * The banner is only printed if the bootloader stays active though, a
+ * normal boot jumps straight to the application without any output,
+ * as printing it at 9600 baud alone would delay the boot by ~45ms.
  *
  * To enable debug information, use the nodebug Makefile target which
  * passes -DDEBUG to the compiler (both uart.c and main.c need DEBUG
@@ -64,12 +83,134 @@
  *
  * With debug information enabled, excessive additional information
  * is written to UART, including the entire firmware byte by byte as
- * it is received. While this is interesting to see, it significantly
- * slows down the flashing processing, so it's probably best to not
- * use the debug mode on a normal basis.
+ * it is received. UART output is buffered and sent from the main loop,
+ * so it won't slow down the flashing process, but at 9600 baud there's
+ * no way to keep up with it either. Whatever doesn't fit in the buffer
+ * is dropped, and the number of dropped characters is printed on BYE.
+ * So while this is interesting to see, it's probably best to not use
+ * the debug mode on a normal basis.
+ *
+ * For timing analysis, use the trace Makefile target instead, which
+ * records timestamped events in RAM that can be read via USB with the
+ * trace.py script. See trace.h for details. To see where the time goes
+ * over a whole firmware update, the timing Makefile target collects the
+ * durations of page erases and writes, chunk reception and holding off
+ * the host into histograms instead, read via USB with timing.py. See
+ * timing.h for details.
  *
  * Also, enabling debug information adds roughly an extra 1kB to the
  * rather sparse memory of the bootloader section.
+ *
+ *
+ * Memory pages can be sent either raw or compressed. Compressed pages
+ * use a simple LZSS format that unpacks into exactly one memory page:
+ *
+ * The stream is a sequence of groups, each starting with a flag byte
+ * followed by up to eight items. Flag bits are read LSB first, a set
+ * bit stands for a literal byte that is copied as-is, a cleared bit
+ * stands for a two byte back reference:
+ *
+ *     oooollll oooooooo
+ *
+ * with a 12-bit offset (stored as offset - 1) in the high nibble of
+ * the first byte and the entire second byte, and a 4-bit length
+ * (stored as length - LZ_MIN_MATCH) in the low nibble of the first
+ * byte. The offset is counted backwards from the current position
+ * in the application's address space, so references can reach into
+ * the previously flashed memory pages just as well as into the part
+ * of the current page that is already unpacked. This way, the whole
+ * already written firmware serves as dictionary, and no additional
+ * RAM is needed for a history window.
+ *
+ *
+ * To avoid starting a half-written application after an interrupted
+ * firmware update, the application state is kept in a small record at
+ * the end of the EEPROM. Initializing a firmware update marks it as
+ * being updated, and only finalizing the update with a matching CRC32
+ * marks it as valid again. The bootloader simply checks that record on
+ * startup, so there's no need to go through the entire flash memory on
+ * every boot. An untouched record (e.g. after flashing the application
+ * via ISP) is trusted as well, only an update left unfinished isn't.
+ *
+ *
+ * The application firmware carries an image header right after its
+ * interrupt vector table (see device/main.c), containing its length,
+ * CRC32 and the hash of the backend build it originates from. If the
+ * application is valid and has such a header, it is appended to the
+ * banner in the CMD_HELLO response, so the host can tell which build
+ * is installed and skip flashing the very same one again.
+ *
+ * To let the host pick the best way to talk to the bootloader without
+ * having to know every bootloader version, the CMD_HELLO response also
+ * contains a capability block right after the banner, telling the page
+ * size, application section size, maximum transfer size and a set of
+ * supported features. The block starts with its own size, so it can be
+ * extended later on, and the image header follows right after it.
+ *
+ * Erasing a memory page takes about as long as writing it. To get that
+ * out of the way, the host can request a range of pages to be erased
+ * right after initializing the update. The main loop then erases them
+ * one by one in the background while the data is still on its way, and
+ * each page only needs to be written once it arrives.
+ *
+ * While flashing, the bootloader also posts notifications on its
+ * interrupt-IN endpoint: one for each written page, one for each page
+ * that couldn't be written, and a final one once all pages of a
+ * CMD_FWUPDATE_MEMPAGE request are written. The final one contains the
+ * CRC32 of the flash memory the request has written, so the host can
+ * check it against its own data instead of reading all of it back via
+ * CMD_FWUPDATE_VERIFY, and send the next pages right away.
+ *
+ * Each flash memory page is only good for about 10k erase cycles, so the
+ * bootloader counts how often it erased the flash memory. There's one
+ * 16-bit counter for each block of WEAR_BLOCK_PAGES pages, covering the
+ * entire flash memory no matter where the bootloader starts, so they stay
+ * in the same place in the reserved part of the EEPROM for every build.
+ * A counter only goes up when the most worn page of its block may have
+ * been erased once more (see wear_mark()), so it tells how often that one
+ * was erased, rounding up if unsure. Erases are collected in RAM and added
+ * to the counters from the main loop (see wear_flush()), a block counted
+ * more than once before that is only counted once. The host can read them
+ * via CMD_WEAR_READ (see wear.py) to spot devices close to wearing out.
+ *
+ * Verifying every transfer before sending the next one costs a round trip
+ * each time, which adds up on slow or shared USB hubs, and a single bad
+ * page means sending the whole transfer again. So since protocol revision
+ * PROTOCOL_WINDOW, the host can send a window of up to WINDOW_SIZE chunks
+ * instead, each with a sequence number in front and a CRC16 at the end
+ * (see MEMPAGE_WINDOW). Chunks with a bad CRC16 aren't written at all,
+ * and CMD_FWUPDATE_ACK tells the host which ones of the window were, so
+ * it only needs to resend the others. The window can be sent in as many
+ * requests as the host likes, and a request with a new window number in
+ * its index parameter starts the next window.
+ *
+ *
+ * When built with -DSTAGED (make staged), the application section is
+ * split into two halves. The application runs from the lower, active
+ * slot, and a firmware update is written into the upper, staging slot.
+ * The active application stays untouched and valid throughout the
+ * transfer, and only once the update is finalized with a matching CRC32
+ * the staging slot is copied over the active one. The application record
+ * is marked as committing during the copy, so if it's interrupted, the
+ * copy is simply finished on the next startup. A failed or abandoned
+ * update therefore leaves the old application running, at the cost of
+ * only half the flash memory being available for it.
+ *
+ *
+ * When built with -DLEAN (make lean), the bootloader fits into a 2kB boot
+ * section at 0x7800, leaving another 2kB of flash to the application.
+ * It's down to one raw memory page per CMD_FWUPDATE_MEMPAGE request,
+ * VERIFY, CRC32 validation and the idle timeout then. There's no UART
+ * output, no LED, no application image header in the HELLO response, and
+ * none of multi-page transfers, compression, erase ahead, notifications,
+ * windows, flash and EEPROM access or wear counters. The host can tell
+ * from the capability block, and the fuses need to be set for the smaller
+ * boot section (make fuses-lean). On the V-USB side, the interrupt-IN
+ * endpoint, long transfers and flow control go away as well. A single
+ * chunk fits into a short transfer, and as it's only complete with the
+ * last packet, it's written before V-USB takes the next one anyway. The
+ * build fails if the result doesn't fit into the boot section (see
+ * Makefile).
  */
 
 /*
@@ -87,41 +228,436 @@
 /** Bootloader enable pin number */
 #define BOOTLOADER_ENABLE_PIN  0
 
+/**
+ * Address of the bootloader request key written by the application.
+ * This is the topmost word in RAM, which only ever holds the return
+ * address of main(), and main() never returns anyway.
+ */
+#define BOOT_KEY_ADDR ((volatile uint16_t *) (RAMEND - 1))
+/** Bootloader request key, must match the one in device/main.c */
+#define BOOT_KEY 0xb007
+/**
+ * Application start key, written by the bootloader itself before resetting
+ * after an idle timeout, so the application is started even if the enable
+ * pin is still held.
+ */
+#define START_KEY 0x57a7
+
+#ifndef BOOTLOAD_ADDR
+#error "BOOTLOAD_ADDR not defined, it's passed from the Makefile"
+#endif
+#ifndef IDLE_TIMEOUT
+/** Seconds without USB request until a valid application is started, 0 to never time out */
+#define IDLE_TIMEOUT 0
+#endif
+/** Number of Timer0 overflows per second, running at F_CPU / 1024 */
+#define IDLE_TICKS_PER_SECOND (F_CPU / 1024 / 256)
+
+#ifdef STAGED
+/** Size of the application, half of everything below the bootloader */
+#define APP_SIZE ((BOOTLOAD_ADDR / 2) & ~(SPM_PAGESIZE - 1))
+/** Flash address of the staging slot firmware updates are written to */
+#define STAGING_ADDR APP_SIZE
+#else
+/** Size of the application, everything below the bootloader */
+#define APP_SIZE BOOTLOAD_ADDR
+/** Firmware updates are written straight to the application itself */
+#define STAGING_ADDR 0
+#endif
+/** Number of memory pages available for the application */
+#define APP_PAGES (APP_SIZE / SPM_PAGESIZE)
+/** Get the offset of the given memory page within the application firmware */
+#define page_offset(page) ((uint16_t) (page) * SPM_PAGESIZE)
+/** Get the flash address the given application memory page is written to */
+#define page_address(page) (STAGING_ADDR + page_offset(page))
+/** Flash address right after the area firmware updates are written to */
+#define STAGING_END (STAGING_ADDR + APP_SIZE)
+/** Number of bytes in a bitmap with one bit for each application memory page */
+#define PAGE_BITMAP_SIZE ((APP_PAGES + 7) / 8)
+/** Check if the given page's bit is set in the given page bitmap */
+#define page_bit_get(map, page) ((map)[(page) >> 3] & (1 << ((page) & 7)))
+/** Set the given page's bit in the given page bitmap */
+#define page_bit_set(map, page) ((map)[(page) >> 3] |= (1 << ((page) & 7)))
+/** Clear the given page's bit in the given page bitmap */
+#define page_bit_clear(map, page) ((map)[(page) >> 3] &= ~(1 << ((page) & 7)))
+
+/** Number of flash memory pages sharing a wear counter, 1, 2, 4 or 8 */
+#define WEAR_BLOCK_PAGES 4
+/** Size of the flash memory block counted by each wear counter in bytes */
+#define WEAR_BLOCK_SIZE (WEAR_BLOCK_PAGES * SPM_PAGESIZE)
+/** Number of wear counters, covering the entire flash memory independent of BOOTLOAD_ADDR */
+#define WEAR_COUNTERS ((FLASHEND + 1) / WEAR_BLOCK_SIZE)
+/** Number of bytes at the end of the EEPROM reserved for the bootloader's records */
+#define EEPROM_RECORDS 32
+/** Number of bytes at the end of the EEPROM reserved for the bootloader */
+#define EEPROM_RESERVED (EEPROM_RECORDS + WEAR_COUNTERS * sizeof(uint16_t))
+/** EEPROM address of the wear counters, right before the records, the same in every build */
+#define WEAR_ADDR ((uint16_t *) (E2END + 1 - EEPROM_RESERVED))
+/** Size of the EEPROM area the application can use and the host can write to */
+#define EEPROM_APP_SIZE (E2END + 1 - EEPROM_RESERVED)
+
+/** Bootloader major version */
+#define VERSION_MAJOR 1
+/** Bootloader minor version, increased with each protocol extension */
+#define VERSION_MINOR 13
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
 /** Bootloader version string */
-#define VERSION "1.0"
-/** Bootloader banner, sent as response to a valid CMD_HELLO request */
-uint8_t banner[] = "Ledmacher Bootloader " VERSION;
+#define VERSION TO_STRING(VERSION_MAJOR) "." TO_STRING(VERSION_MINOR)
+/** Bootloader banner string */
+#define BANNER "Ledmacher Bootloader " VERSION
+
+/** Magic number at the start of the application image header, "LEDM" in ASCII */
+#define IMAGE_MAGIC 0x4d44454cUL
+/** Flash address of the application image header, right after the interrupt vectors */
+#define IMAGE_HEADER_ADDR _VECTORS_SIZE
+
+/** Application image header, must match the one in device/main.c */
+typedef struct {
+    /** Magic number, IMAGE_MAGIC */
+    uint32_t magic;
+    /** Application firmware size in bytes */
+    uint16_t length;
+    /** First bytes of the backend build hash, or all zero for local builds */
+    uint8_t build_hash[8];
+    /** CRC32 of the application firmware following the header */
+    uint32_t crc;
+} image_header_t;
+
+/** Feature flag: compressed memory pages, see MEMPAGE_COMPRESSED */
+#define FEATURE_COMPRESSION     0x01
+/** Feature flag: multiple memory pages in a single CMD_FWUPDATE_MEMPAGE request */
+#define FEATURE_MULTI_PAGE      0x02
+/** Feature flag: CRC32 validation via CMD_FWUPDATE_FINALIZE and CMD_FWUPDATE_CRC */
+#define FEATURE_CRC             0x04
+/** Feature flag: bulk flash read via CMD_FLASH_READ */
+#define FEATURE_FLASH_READ      0x08
+/** Feature flag: EEPROM access via CMD_EEPROM_READ and CMD_EEPROM_WRITE */
+#define FEATURE_EEPROM          0x10
+/** Feature flag: event trace via CMD_TRACE */
+#define FEATURE_TRACE           0x20
+/** Feature flag: background page erase via CMD_FWUPDATE_ERASE */
+#define FEATURE_ERASE_AHEAD     0x40
+/** Feature flag: flashing notifications on the interrupt-IN endpoint */
+#define FEATURE_NOTIFY          0x80
+/** Extended feature flag: flash wear counters via CMD_WEAR_READ */
+#define FEATURE_EXT_WEAR        0x01
+/** Extended feature flag: timing histograms via CMD_TIMING */
+#define FEATURE_EXT_TIMING      0x02
+
+#ifdef TRACE
+#define FEATURES_TRACE FEATURE_TRACE
+#else
+#define FEATURES_TRACE 0
+#endif
+#ifdef TIMING
+#define FEATURES_TIMING FEATURE_EXT_TIMING
+#else
+#define FEATURES_TIMING 0
+#endif
+/** All features supported by this bootloader build */
+#define FEATURES (FEATURE_COMPRESSION | FEATURE_MULTI_PAGE | FEATURE_CRC | \
+        FEATURE_FLASH_READ | FEATURE_EEPROM | FEATURE_ERASE_AHEAD | FEATURE_NOTIFY | \
+        FEATURES_TRACE)
+/** All extended features supported by this bootloader build */
+#define FEATURES_EXT (FEATURE_EXT_WEAR | FEATURES_TIMING)
+
+/** Protocol revision: memory pages sent as chunks, verified per transfer */
+#define PROTOCOL_CHUNKS 1
+/** Protocol revision: chunks sent in windows, see MEMPAGE_WINDOW */
+#define PROTOCOL_WINDOW 2
+/** Memory page transfer protocol revision of this bootloader build */
+#define PROTOCOL_REVISION PROTOCOL_WINDOW
+/** Maximum number of chunks in a window, one bit each in CMD_FWUPDATE_ACK */
+#define WINDOW_SIZE 16
+
+#ifdef LEAN
+#if defined(STAGED) || defined(TRACE) || defined(TIMING) || defined(DEBUG)
+#error "LEAN can't be combined with STAGED, TRACE, TIMING or DEBUG"
+#endif
+#undef FEATURES
+#define FEATURES FEATURE_CRC
+#undef FEATURES_EXT
+#define FEATURES_EXT 0
+#undef PROTOCOL_REVISION
+#define PROTOCOL_REVISION PROTOCOL_CHUNKS
+#undef WINDOW_SIZE
+#define WINDOW_SIZE 0
+#endif
+
+/** Maximum number of bytes in a single CMD_FWUPDATE_MEMPAGE request */
+#ifndef LEAN
+#define MAX_TRANSFER_SIZE 0xffff
+#else
+/* A single chunk, see CHUNK_HEADER_SIZE */
+#define MAX_TRANSFER_SIZE (3 + SPM_PAGESIZE)
+#endif
+
+/** Bootloader capabilities, sent as part of the CMD_HELLO response */
+typedef struct {
+    /** Size of this structure in bytes */
+    uint8_t size;
+    /** Bootloader major version */
+    uint8_t version_major;
+    /** Bootloader minor version */
+    uint8_t version_minor;
+    /** Flash memory page size in bytes */
+    uint16_t page_size;
+    /** Size of the application section in bytes */
+    uint16_t app_size;
+    /** Maximum number of bytes in a single CMD_FWUPDATE_MEMPAGE request */
+    uint16_t max_transfer;
+    /** Size of the EEPROM area writable via CMD_EEPROM_WRITE in bytes */
+    uint16_t eeprom_size;
+    /** Supported features, any of the FEATURE_* flags */
+    uint8_t features;
+    /** Supported extended features, any of the FEATURE_EXT_* flags */
+    uint8_t features_ext;
+    /** Memory page transfer protocol revision, one of the PROTOCOL_* values */
+    uint8_t protocol;
+    /** Maximum number of chunks in a window, 0 if windows aren't supported */
+    uint8_t window_size;
+} capabilities_t;
+
+/**
+ * Response to a valid CMD_HELLO request.
+ * Contains the banner with its trailing \0 and the capabilities,
+ * optionally followed by the application image header.
+ */
+static struct {
+    uint8_t banner[sizeof(BANNER)];
+    capabilities_t caps;
+#ifndef LEAN
+    image_header_t header;
+#endif
+} hello_reply = {
+    .banner = BANNER,
+    .caps = {
+        .size = sizeof(capabilities_t),
+        .version_major = VERSION_MAJOR,
+        .version_minor = VERSION_MINOR,
+        .page_size = SPM_PAGESIZE,
+        .app_size = APP_SIZE,
+        .max_transfer = MAX_TRANSFER_SIZE,
+        .eeprom_size = EEPROM_APP_SIZE,
+        .features = FEATURES,
+        .features_ext = FEATURES_EXT,
+        .protocol = PROTOCOL_REVISION,
+        .window_size = WINDOW_SIZE,
+    },
+};
 
 void wdt_init(void) __attribute__((naked)) __attribute__((section(".init3")));
-void program(void);
 
-/** Expected length of data to receive during CMD_FWUPDATE_MEMPAGE request */
+/** Flag set in wdt_init() if the application requested the bootloader */
+static uint8_t boot_requested __attribute__((section(".noinit")));
+/** Flag set in wdt_init() if the bootloader reset itself to start the application */
+static uint8_t start_requested __attribute__((section(".noinit")));
+uint8_t recv_collect(uchar *data, uchar len);
+void recv_write(void);
+uint8_t program(void);
+#ifndef LEAN
+void erase_ahead(void);
+uint8_t erased_ahead(uint16_t page);
+void notify(uint8_t event, uint8_t status, uint16_t page, uint32_t crc);
+void notify_send(void);
+void wear_mark(uint16_t address);
+void wear_flush(void);
+uint8_t decompress(void);
+#else
+/* Left out of the lean build along with the features they belong to */
+#define erase_ahead()
+#define erased_ahead(page) 0
+#define notify(event, status, page, crc)
+#define notify_send()
+#define wear_mark(address)
+#define wear_flush()
+#endif
+uint32_t crc32(uint16_t address, uint16_t len);
+#ifdef STAGED
+void commit(void);
+#endif
+uint8_t app_valid(void);
+#ifndef LEAN
+void print_banner(uint8_t bootloader_enabled);
+#endif
+
+/** Remaining length of data to receive during CMD_FWUPDATE_MEMPAGE request */
 static uint16_t recv_len;
-/** Actual length of data received so far in a CMD_FWUPDATE_MEMPAGE request */
+/** Actual length of data received so far for the current chunk */
 static uint16_t recv_cnt;
-/** Flag to check if all the expected data has been received */
+/** Flag if a complete chunk is waiting to be written */
 static uint8_t recv_all;
+/** Flag to check if the next chunk is the first one in a CMD_FWUPDATE_MEMPAGE request */
+static uint8_t recv_first;
+/** Flag if the ongoing CMD_FWUPDATE_MEMPAGE request was given up on invalid data */
+static uint8_t recv_error;
+#ifndef LEAN
+/** Data received after a complete chunk, kept until the chunk is written */
+static uint8_t recv_rest[8];
+/** Index of the next byte to collect from recv_rest */
+static uint8_t recv_rest_pos;
+/** Number of bytes left to collect from recv_rest */
+static uint8_t recv_rest_len;
+#endif
+/** Flag if the data of the ongoing request is written to EEPROM instead of flash */
+static uint8_t recv_eeprom;
+#ifndef LEAN
+/** Flag if the ongoing CMD_FWUPDATE_MEMPAGE request sends a window, see MEMPAGE_WINDOW */
+static uint8_t recv_window;
+/** CRC16 of the current chunk so far, only in windows */
+static uint16_t recv_crc;
+/** EEPROM address to write the next received byte in a CMD_EEPROM_WRITE request to */
+static uint16_t eeprom_addr;
+#endif
+
+/** Size of the header in front of each firmware data chunk */
+#define CHUNK_HEADER_SIZE 3
+/** Size of the header in front of each chunk in a window, including the sequence number */
+#define WINDOW_HEADER_SIZE (CHUNK_HEADER_SIZE + 1)
+/** Size of the CRC16 at the end of each chunk in a window */
+#define WINDOW_CRC_SIZE 2
 
 /** Firmware data chunk */
 typedef struct {
-    /** Memory page number this chunk should be written to */
-    uint8_t page;
+    /** Sequence number within the window, only sent in windows */
+    uint8_t seq;
+    /** Memory page number this chunk should be written to, starting from 0 */
+    uint16_t page;
     /** Size of the data within this chunk */
     uint8_t size;
-    /** The actual data */
-    uint8_t data[SPM_PAGESIZE];
+    /** The actual data, followed by the CRC16 in windows */
+    uint8_t data[SPM_PAGESIZE + WINDOW_CRC_SIZE];
 } recv_chunk_t;
 
 /** Number of total memory pages to write during a firmware update process */
-uint8_t number_of_pages;
+uint16_t number_of_pages;
+/** Firmware size in bytes, as announced by the host or based on the written pages */
+static uint16_t image_len;
 
 /** Firmware chunk data received from the host */
 static recv_chunk_t recv_data;
+#ifndef LEAN
+/** Compressed firmware chunk data received from the host */
+static recv_chunk_t comp_data;
+#endif
+/** Chunk the data of an ongoing CMD_FWUPDATE_MEMPAGE request is written to */
+static recv_chunk_t *recv_chunk;
+
+#ifndef LEAN
+/** Chunks of the current window written so far, sent in a CMD_FWUPDATE_ACK request */
+static struct {
+    /** Window number, the index parameter of the CMD_FWUPDATE_MEMPAGE requests */
+    uint16_t window;
+    /** Written chunks, one bit for each sequence number */
+    uint16_t acked;
+} window_ack;
+#else
+/* Windows aren't part of the lean build */
+#define recv_window 0
+#endif
+
+/** First memory page written in the last CMD_FWUPDATE_MEMPAGE request */
+static uint16_t verify_page;
+/** Flash or EEPROM address to send data from in a CMD_FWUPDATE_VERIFY or CMD_*_READ request */
+static uint16_t repl_addr;
+/** Flag if the data sent in the ongoing request is read from EEPROM instead of flash */
+static uint8_t repl_eeprom;
+/** Total number of bytes to send in a CMD_FWUPDATE_VERIFY or CMD_FLASH_READ request */
+static uint16_t repl_len;
+/** Number of bytes sent so far in a CMD_FWUPDATE_VERIFY or CMD_FLASH_READ request */
+static uint16_t repl_cnt;
+/** CRC32 value sent in a CMD_FWUPDATE_CRC request */
+static uint32_t crc_reply;
+
+#ifndef LEAN
+/** Memory pages requested via CMD_FWUPDATE_ERASE that still need to be erased */
+static uint8_t erase_pending[PAGE_BITMAP_SIZE];
+/** Memory pages erased ahead that haven't been written since */
+static uint8_t erase_done[PAGE_BITMAP_SIZE];
+/** First memory page that may still be pending to be erased */
+static uint16_t erase_next;
+#endif
+
+/** Notification: memory page written, page tells which one */
+#define NOTIFY_PAGE_DONE    0x01
+/** Notification: memory page couldn't be written, status tells why */
+#define NOTIFY_ERROR        0x02
+/** Notification: CMD_FWUPDATE_MEMPAGE request done, crc covers all its written data */
+#define NOTIFY_READY        0x03
+
+/** Notification error status: compressed memory page data couldn't be unpacked */
+#define NOTIFY_ERR_DECOMPRESS   0x01
+/** Notification error status: memory page is outside the application section */
+#define NOTIFY_ERR_PAGE_RANGE   0x02
+/** Notification error status: chunk is bigger than a memory page */
+#define NOTIFY_ERR_CHUNK_SIZE   0x03
+/** Notification error status: chunk in a window has a bad CRC16 or sequence number */
+#define NOTIFY_ERR_CHUNK_CRC    0x04
+
+#ifndef LEAN
+/** Notification sent to the host on the interrupt-IN endpoint */
+typedef struct {
+    /** Notification type, one of the NOTIFY_* values */
+    uint8_t event;
+    /** Error status for NOTIFY_ERROR, one of the NOTIFY_ERR_* values, 0 otherwise */
+    uint8_t status;
+    /** Memory page the notification refers to, the last one for NOTIFY_READY */
+    uint16_t page;
+    /** CRC32 of the data written in the request for NOTIFY_READY, 0 otherwise */
+    uint32_t crc;
+} notify_t;
+
+/** Number of notifications queued up until the host reads them */
+#define NOTIFY_ENTRIES 8
+/** Queued notifications */
+static notify_t notify_queue[NOTIFY_ENTRIES];
+/** Index of the next notification to send */
+static uint8_t notify_head;
+/** Number of queued notifications */
+static uint8_t notify_count;
+#endif
+/** Flag if a CMD_FWUPDATE_MEMPAGE request is done and NOTIFY_READY is due */
+static uint8_t recv_done;
+/** Flash address right after the data of the last written chunk */
+static uint16_t recv_end;
+
+#ifndef LEAN
+/** Flash memory blocks erased since their wear counter was last updated */
+static uint8_t wear_pending[(WEAR_COUNTERS + 7) / 8];
+/** Memory pages erased since their block's wear counter was last increased */
+static uint8_t wear_seen[(FLASHEND + 1) / SPM_PAGESIZE / 8];
+/** Lowest flash memory block that may have a pending wear counter update */
+static uint8_t wear_next = WEAR_COUNTERS;
+#endif
+
+#if IDLE_TIMEOUT > 0
+/** Number of Timer0 overflows since the last USB request */
+static uint16_t idle_ticks;
+#endif
+
+/** Application state record, stored at the end of the EEPROM */
+typedef struct {
+    /** Application state, one of the APP_STATE_* values */
+    uint8_t state;
+    /** Application firmware size in bytes */
+    uint16_t length;
+    /** CRC32 of the application firmware */
+    uint32_t crc;
+} app_record_t;
+
+/** EEPROM address of the application state record */
+#define APP_RECORD_ADDR ((app_record_t *) (E2END + 1 - sizeof(app_record_t)))
 
-/** Total number of bytes to send in a CMD_FWUPDATE_VERIFY request */
-static uint8_t repl_len;
-/** Number of bytes sent so far in a CMD_FWUPDATE_VERIFY request */
-static uint8_t repl_cnt;
+void record_update(const app_record_t *record);
+/** Application state record was never written, e.g. application was flashed via ISP */
+#define APP_STATE_UNKNOWN   0xff
+/** Application firmware update was finalized with matching CRC32 */
+#define APP_STATE_VALID     0xa5
+/** Application firmware update was initialized but never finalized */
+#define APP_STATE_UPDATING  0x5a
+/** Application firmware update is being copied from the staging slot, STAGED only */
+#define APP_STATE_COMMITTING 0xc3
 
 
 /** USB request to establish a connection */
@@ -134,10 +670,28 @@ static uint8_t repl_cnt;
 #define CMD_FWUPDATE_VERIFY     0x12
 /** USB request finalize the firmware update */
 #define CMD_FWUPDATE_FINALIZE   0x13
+/** USB request to get the CRC32 of the written firmware */
+#define CMD_FWUPDATE_CRC        0x14
+/** USB request to read back an arbitrary part of the application flash memory */
+#define CMD_FLASH_READ          0x15
+/** USB request to erase a range of memory pages in the background */
+#define CMD_FWUPDATE_ERASE      0x16
+/** USB request to read the flash wear counters */
+#define CMD_WEAR_READ           0x17
+/** USB request to get the written chunks of the current window */
+#define CMD_FWUPDATE_ACK        0x18
+/** USB request to read a range of EEPROM */
+#define CMD_EEPROM_READ         0x20
+/** USB request to write a range of the application's EEPROM area */
+#define CMD_EEPROM_WRITE        0x21
 /** USB request to end an ongoing connection */
 #define CMD_BYE                 0xf0
 /** USB request to reset the device */
 #define CMD_RESET               0xfa
+/** USB request to read the event trace buffer, only in trace builds */
+#define CMD_TRACE               0x30
+/** USB request to read the timing histograms, only in timing builds */
+#define CMD_TIMING              0x31
 
 /** Device is in idle state, waiting for CMD_HELLO */
 #define ST_IDLE     0
@@ -150,15 +704,37 @@ static uint8_t repl_cnt;
 /** The device's internal state */
 uint8_t state = ST_IDLE;
 
+/** CMD_FWUPDATE_MEMPAGE value parameter for raw memory page data */
+#define MEMPAGE_RAW         0
+/** CMD_FWUPDATE_MEMPAGE value parameter for compressed memory page data */
+#define MEMPAGE_COMPRESSED  1
+/**
+ * CMD_FWUPDATE_MEMPAGE value parameter flag for a window, combined with
+ * either of the above. Each chunk then starts with its sequence number
+ * within the window, followed by the usual header and data, and ends with
+ * the CRC16 (XMODEM, big endian) of all that, so the CRC16 over the whole
+ * chunk is zero. The index parameter contains the window number.
+ *
+ * Raw chunks are acknowledged each on its own. Compressed ones may refer
+ * back into any page before them, so they're acknowledged cumulatively,
+ * i.e. a chunk is only written once all the ones in front of it are.
+ */
+#define MEMPAGE_WINDOW      2
+
+/** Shortest back reference length in compressed memory page data */
+#define LZ_MIN_MATCH 3
+
 /** Magic number epxected as value parameter in a CMD_HELLO request */
 #define HELLO_VALUE 0x4d6f
 /** Magic number epxected as index parameter in a CMD_HELLO request */
 #define HELLO_INDEX 0x6921
 
+#ifndef LEAN
 /** Maximum number of LEDs */
 #define NUM_LEDS 8
 /** The LEDs */
 struct cRGB leds[NUM_LEDS];
+#endif
 
 
 /**
@@ -167,11 +743,16 @@ struct cRGB leds[NUM_LEDS];
  * Handle all the control transfer commends, i.e. handle the main parts of
  * all the USB communication between the host and the bootloader.
  */
-uchar
+usbMsgLen_t
 usbFunctionSetup(uchar data[8])
 {
     usbRequest_t *rq = (void *) data;
 
+    trace(TRACE_SETUP, rq->bRequest);
+#if IDLE_TIMEOUT > 0
+    idle_ticks = 0;
+#endif
+
     switch (rq->bRequest) {
         case CMD_HELLO:
             /*
@@ -187,10 +768,18 @@ usbFunctionSetup(uchar data[8])
                 state = ST_HELLO;
                 /*
                  * Send banner as response back to the host so it can
-                 * verify this is a device it actually expects.
+                 * verify this is a device it actually expects, along
+                 * with the capabilities and the image header of a
+                 * valid application.
                  */
-                usbMsgPtr = banner;
-                return sizeof(banner);
+                usbMsgPtr = (usbMsgPtr_t) &hello_reply;
+#ifndef LEAN
+                if (app_valid() && pgm_read_dword((void *) IMAGE_HEADER_ADDR) == IMAGE_MAGIC) {
+                    memcpy_P(&hello_reply.header, (void *) IMAGE_HEADER_ADDR, sizeof(image_header_t));
+                    return sizeof(hello_reply);
+                }
+#endif
+                return sizeof(hello_reply.banner) + sizeof(hello_reply.caps);
             }
             break;
 
@@ -200,10 +789,34 @@ usbFunctionSetup(uchar data[8])
              * Requires to be in idle state, so the device can rely that the
              * host actually knows what device it's communicating with, and
              * actually means to update the firmware as next step here.
+             *
+             * The firmware must fit into the application section, i.e.
+             * everything below the bootloader, otherwise it's refused.
+             * The index parameter optionally contains the exact firmware
+             * size in bytes, otherwise it's based on the written pages.
+             * A size beyond the application section is refused as well,
+             * as FINALIZE calculates the CRC32 over that many bytes.
+             *
+             * From here on, the application is considered invalid until
+             * the update is finalized. Unless it's a STAGED build, where
+             * the application itself isn't touched before that.
              */
-            if (state == ST_HELLO) {
+            if (state == ST_HELLO && rq->wValue.word <= APP_PAGES && rq->wIndex.word <= APP_SIZE) {
                 state = ST_FWUPDATE;
                 number_of_pages = rq->wValue.word;
+                image_len = rq->wIndex.word;
+#ifndef LEAN
+                memset(erase_pending, 0, sizeof(erase_pending));
+                memset(erase_done, 0, sizeof(erase_done));
+                erase_next = APP_PAGES;
+                notify_count = 0;
+                window_ack.window = 0;
+                window_ack.acked = 0;
+#endif
+                timing_reset();
+#ifndef STAGED
+                eeprom_update_byte(&APP_RECORD_ADDR->state, APP_STATE_UPDATING);
+#endif
 #ifdef DEBUG
                 uart_print("INIT: ");
                 uart_putint(number_of_pages, 1);
@@ -216,12 +829,37 @@ usbFunctionSetup(uchar data[8])
 
         case CMD_FWUPDATE_MEMPAGE:
             /*
-             * Receive a single memory page of the firmware data.
+             * Receive memory pages of the firmware data.
              * Requires to be in firmware update state.
+             *
+             * A single request can contain any number of consecutive
+             * chunks, each one made of its header and the page data.
+             * Every chunk is written as soon as it is fully received.
+             *
+             * The value parameter tells if the page data is sent raw or
+             * compressed, and compressed data is collected separately
+             * to get unpacked into the actual page buffer later on.
+             * It also tells if the chunks are part of a window, and a
+             * window number other than the current one starts a new one.
              */
             if (state == ST_FWUPDATE) {
                 recv_cnt = 0;
+                recv_first = 1;
+                recv_error = 0;
+                recv_eeprom = 0;
                 recv_len = rq->wLength.word;
+#ifndef LEAN
+                recv_chunk = (rq->wValue.word & MEMPAGE_COMPRESSED) ? &comp_data : &recv_data;
+                recv_window = (rq->wValue.word & MEMPAGE_WINDOW) != 0;
+                if (recv_window && rq->wIndex.word != window_ack.window) {
+                    window_ack.window = rq->wIndex.word;
+                    window_ack.acked = 0;
+                }
+                /* Notifications left over from earlier requests are of no interest anymore */
+                notify_count = 0;
+#else
+                recv_chunk = &recv_data;
+#endif
 #ifdef DEBUG
                 uart_print("MEMPAGE: ");
                 uart_putint(recv_len, 1);
@@ -238,22 +876,78 @@ usbFunctionSetup(uchar data[8])
             }
             break;
 
+#ifndef LEAN
+        case CMD_FWUPDATE_ERASE:
+            /*
+             * Erase a range of memory pages ahead of writing them.
+             * The value parameter contains the first page, the index
+             * parameter the number of pages. The pages are only marked
+             * here, and get erased one by one from the main loop while
+             * the host is already sending memory page data, so writing
+             * each page later on doesn't have to wait for the erase.
+             * Requires to be in firmware update state.
+             */
+            if (state == ST_FWUPDATE && rq->wValue.word < APP_PAGES) {
+                uint16_t page = rq->wValue.word;
+                uint16_t end = APP_PAGES;
+
+                if (rq->wIndex.word < (uint16_t) (APP_PAGES - page)) {
+                    end = page + rq->wIndex.word;
+                }
+                if (page < erase_next) {
+                    erase_next = page;
+                }
+                for (; page < end; page++) {
+                    page_bit_set(erase_pending, page);
+                }
+                uart_print("FWUPDATE_ERASE\r\n");
+            }
+            break;
+#endif
+
+#ifndef LEAN
+        case CMD_FWUPDATE_ACK:
+            /*
+             * Send back the current window number along with the chunks
+             * of it written so far. The last CMD_FWUPDATE_MEMPAGE request
+             * is done by now, as V-USB only takes a new request once the
+             * previous one is finished. Chunks that aren't acknowledged
+             * need to be sent again, which for compressed data includes
+             * all the ones after the first missing one, see MEMPAGE_WINDOW.
+             * Requires to be in firmware update state.
+             */
+            if (state == ST_FWUPDATE) {
+                uart_print("FWUPDATE_ACK\r\n");
+                usbMsgPtr = (usbMsgPtr_t) &window_ack;
+                return sizeof(window_ack);
+            }
+            break;
+#endif
+
         case CMD_FWUPDATE_VERIFY:
             /*
              * Verify the last transferred memory page data.
              * Sends the received data back to the host so it can compare it
-             * and decide whether to move on or resend it again.
+             * and decide whether to move on or resend it again. The data is
+             * read starting from the first page of the last transfer, so
+             * all its pages can be verified at once.
              * Requires to be in firmware update state.
              *
              * Note, this needs to be a receive request.
              */
             if (state == ST_FWUPDATE) {
-                boot_rww_enable();
+                boot_rww_enable_safe();
+                repl_addr = page_address(verify_page);
+                repl_eeprom = 0;
                 repl_len = rq->wLength.word;
                 repl_cnt = 0;
+                /* Never read past the written area */
+                if (repl_len > STAGING_END - repl_addr) {
+                    repl_len = STAGING_END - repl_addr;
+                }
 #ifdef DEBUG
                 uart_print("VERIFY: page ");
-                uart_putint(recv_data.page, 1);
+                uart_putint(verify_page, 1);
                 uart_print(" len ");
                 uart_putint(repl_len, 1);
                 uart_newline();
@@ -277,17 +971,188 @@ usbFunctionSetup(uchar data[8])
              * CMD_FWUPDATE_INIT request.
              */
             if (state == ST_FWUPDATE) {
+                app_record_t record;
+                uint32_t host_crc = ((uint32_t) rq->wIndex.word << 16) | rq->wValue.word;
+
                 uart_print("FINALIZE\r\n");
-                boot_rww_enable();
+                boot_rww_enable_safe();
                 state = ST_HELLO;
+
+                /*
+                 * The host passes the expected CRC32 as value (lower 16 bits)
+                 * and index (upper 16 bits) parameter. If it's zero, the host
+                 * doesn't care, and the per-page verification is trusted.
+                 * Except in a STAGED build, where the update replaces a
+                 * perfectly fine application, so it needs a matching CRC32.
+                 */
+                record.length = image_len;
+                record.crc = crc32(STAGING_ADDR, image_len);
+#ifdef STAGED
+                /*
+                 * A mismatching update is simply dropped, leaving the active
+                 * application and its record as they are. Otherwise, copy it
+                 * over the active application. This blocks USB for as long as
+                 * the copy takes, roughly 9ms per memory page.
+                 */
+                if (host_crc == record.crc) {
+                    record.state = APP_STATE_COMMITTING;
+                    record_update(&record);
+                    commit();
+                }
+#else
+                record.state = (host_crc == 0 || host_crc == record.crc)
+                             ? APP_STATE_VALID : APP_STATE_UPDATING;
+                record_update(&record);
+#endif
             }
             break;
 
+        case CMD_FWUPDATE_CRC:
+            /*
+             * Send the CRC32 of the application firmware back to the host.
+             * The value parameter contains the number of bytes to include,
+             * starting from address 0. If it's zero, the size of the last
+             * firmware update is used.
+             */
+            if (state == ST_HELLO || state == ST_FWUPDATE) {
+                uint16_t len = rq->wValue.word;
+
+                if (len == 0) {
+                    len = eeprom_read_word(&APP_RECORD_ADDR->length);
+                }
+                if (len > APP_SIZE) {
+                    len = APP_SIZE;
+                }
+                uart_print("FWUPDATE_CRC\r\n");
+                boot_rww_enable_safe();
+                crc_reply = crc32(0, len);
+                usbMsgPtr = (usbMsgPtr_t) &crc_reply;
+                return sizeof(crc_reply);
+            }
+            break;
+
+#ifndef LEAN
+        case CMD_FLASH_READ:
+            /*
+             * Send back any part of the application flash memory, up to
+             * the entire application section, in one single request.
+             * The value parameter contains the start address, the length
+             * is taken from the request itself. Reading is limited to
+             * the application section, so the host gets less data than
+             * requested if it asks for anything beyond that.
+             *
+             * Note, this needs to be a receive request.
+             */
+            if (state == ST_HELLO || state == ST_FWUPDATE) {
+                repl_addr = rq->wValue.word;
+                repl_len = rq->wLength.word;
+                repl_cnt = 0;
+                repl_eeprom = 0;
+
+                if (repl_addr >= BOOTLOAD_ADDR) {
+                    repl_len = 0;
+                } else if (repl_len > BOOTLOAD_ADDR - repl_addr) {
+                    repl_len = BOOTLOAD_ADDR - repl_addr;
+                }
+                uart_print("FLASH_READ\r\n");
+                boot_rww_enable_safe();
+
+                /* Data is sent in usbFunctionRead() */
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_WEAR_READ:
+            /*
+             * Send back the wear counters, two bytes per flash memory block
+             * of WEAR_BLOCK_SIZE bytes in little endian. The value parameter
+             * contains the first block, the length is taken from the request.
+             * Counters are stored and sent as one's complement, see
+             * wear_flush().
+             *
+             * Note, this needs to be a receive request.
+             */
+            if (state == ST_HELLO || state == ST_FWUPDATE) {
+                repl_addr = (uint16_t) (WEAR_ADDR + rq->wValue.word);
+                repl_len = rq->wLength.word;
+                repl_cnt = 0;
+                repl_eeprom = 1;
+
+                if (rq->wValue.word >= WEAR_COUNTERS) {
+                    repl_len = 0;
+                } else if (repl_len > (WEAR_COUNTERS - rq->wValue.word) * sizeof(uint16_t)) {
+                    repl_len = (WEAR_COUNTERS - rq->wValue.word) * sizeof(uint16_t);
+                }
+                uart_print("WEAR_READ\r\n");
+
+                /* Data is sent in usbFunctionRead() */
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_EEPROM_READ:
+            /*
+             * Send back a range of EEPROM. The value parameter contains
+             * the start address, the length is taken from the request.
+             * Reading is limited to the EEPROM size.
+             *
+             * Note, this needs to be a receive request.
+             */
+            if (state == ST_HELLO || state == ST_FWUPDATE) {
+                repl_addr = rq->wValue.word;
+                repl_len = rq->wLength.word;
+                repl_cnt = 0;
+                repl_eeprom = 1;
+
+                if (repl_addr > E2END) {
+                    repl_len = 0;
+                } else if (repl_len > E2END + 1 - repl_addr) {
+                    repl_len = E2END + 1 - repl_addr;
+                }
+                uart_print("EEPROM_READ\r\n");
+
+                /* Data is sent in usbFunctionRead() */
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_EEPROM_WRITE:
+            /*
+             * Receive data to write to EEPROM. The value parameter contains
+             * the start address, the length is taken from the request.
+             * Requires to be in hello state, i.e. not during a firmware
+             * update, and the whole range must be within the application's
+             * EEPROM area, otherwise the data is ignored.
+             *
+             * Only bytes that actually changed are written, each taking
+             * around 3.3ms, so a full configuration is written in well
+             * under a second.
+             */
+            if (state == ST_HELLO &&
+                    rq->wValue.word < EEPROM_APP_SIZE &&
+                    rq->wLength.word <= EEPROM_APP_SIZE - rq->wValue.word)
+            {
+                eeprom_addr = rq->wValue.word;
+                recv_len = rq->wLength.word;
+                recv_eeprom = 1;
+                uart_print("EEPROM_WRITE\r\n");
+
+                /* Data is written in usbFunctionWrite() */
+                return USB_NO_MSG;
+            }
+            break;
+#endif
+
         case CMD_BYE:
             /*
              * Go back to idle state
              */
             uart_print("BYE\r\n");
+#ifdef DEBUG
+            uart_print("UART overflows: ");
+            uart_putint(uart_overflows(), 1);
+            uart_newline();
+#endif
             state = ST_IDLE;
             break;
 
@@ -300,6 +1165,24 @@ usbFunctionSetup(uchar data[8])
                 state = ST_RESET;
             }
             break;
+
+#ifdef TRACE
+        case CMD_TRACE:
+            /*
+             * Send the entire trace buffer, in any state
+             */
+            usbMsgPtr = (usbMsgPtr_t) &trace_buffer;
+            return sizeof(trace_buffer);
+#endif
+
+#ifdef TIMING
+        case CMD_TIMING:
+            /*
+             * Send the timing histograms of the last firmware update, in any state
+             */
+            usbMsgPtr = (usbMsgPtr_t) &timing_buffer;
+            return sizeof(timing_buffer);
+#endif
     }
     return 0;
 }
@@ -312,25 +1195,205 @@ usbFunctionSetup(uchar data[8])
  * but since USB communication is always from the host's point of view,
  * it's a write operation. But we're receiving.
  *
- * In this case, we're receiving the data for single memory page that
- * will be become the device's new application firmware.
+ * In this case, we're receiving the data for a series of memory pages
+ * that will be become the device's new application firmware. The data
+ * is streamed in, and each chunk is written to flash as soon as it is
+ * complete, so the request can span over as many pages as the host wants.
+ * Or, in case of CMD_EEPROM_WRITE, the data is written to EEPROM.
  */
 uchar
 usbFunctionWrite(uchar *data, uchar len)
 {
+    uint8_t used;
+#ifndef LEAN
     uint8_t i;
-    uint8_t *recv_ptr = (uint8_t *) &recv_data;
 
-    for (i = 0; recv_cnt < recv_len && i < len; i++, recv_cnt++) {
-        recv_ptr[recv_cnt] = data[i];
+    if (recv_eeprom) {
+        for (i = 0; recv_len > 0 && i < len; i++, recv_len--) {
+            eeprom_update_byte((uint8_t *) eeprom_addr++, data[i]);
+        }
+        return (recv_len == 0);
+    }
+#endif
+
+    if (recv_error) {
+        return 0xff;
+    }
+
+    if (recv_len <= len) {
+        /*
+         * Last packet of the request, so write all of it right away.
+         * V-USB only finishes the request once this returns, so the host
+         * won't send anything else until all the data is in flash.
+         */
+        while (recv_len > 0 && !recv_error) {
+            used = recv_collect(data, len);
+            data += used;
+            len -= used;
+            if (recv_all) {
+                recv_write();
+            }
+        }
+        recv_done = 1;
+        return (recv_error) ? 0xff : 1;
+    }
+
+    /*
+     * Otherwise, a complete chunk is written from the main loop, and the
+     * host is NAKed until then. As the page write itself carries on in the
+     * background, the next chunk already arrives while it's being written.
+     * The rest of this packet is kept for the next chunk until then.
+     */
+    used = recv_collect(data, len);
+    if (recv_error) {
+        return 0xff;
     }
+#ifndef LEAN
+    if (recv_all) {
+        recv_rest_pos = 0;
+        recv_rest_len = len - used;
+        memcpy(recv_rest, data + used, recv_rest_len);
+        usbDisableAllRequests();
+        timing_start(TIMING_HOLD);
+    }
+#else
+    /* Without flow control, a chunk has to end with the request, see LEAN */
+    if (recv_all) {
+        recv_error = 1;
+        return 0xff;
+    }
+#endif
+    return 0;
+}
 
-    if (recv_cnt == recv_len) {
-        recv_all = 1;
-        program();
+/**
+ * Collect received CMD_FWUPDATE_MEMPAGE data into the chunk buffer.
+ *
+ * Stops right after a chunk is complete, as the buffer can't take any
+ * more data until the chunk is written via recv_write(). In a window,
+ * the chunk's CRC16 is calculated along the way.
+ *
+ * @param data Received data
+ * @param len Number of received bytes
+ * @return Number of bytes taken from data
+ */
+uint8_t
+recv_collect(uchar *data, uchar len)
+{
+    uint8_t *recv_ptr = (uint8_t *) &recv_chunk->page;
+    uint8_t header = CHUNK_HEADER_SIZE;
+    uint8_t trailer = 0;
+    uint8_t i = 0;
+
+    if (recv_window) {
+        /* Sequence number in front of the header, CRC16 after the data */
+        recv_ptr = &recv_chunk->seq;
+        header = WINDOW_HEADER_SIZE;
+        trailer = WINDOW_CRC_SIZE;
     }
 
-    return (recv_cnt == recv_len);
+    while (recv_len > 0 && i < len) {
+        if (recv_cnt == 0) {
+            timing_start(TIMING_RECEIVE);
+#ifndef LEAN
+            recv_crc = 0;
+#endif
+        }
+#ifndef LEAN
+        if (recv_window) {
+            recv_crc = _crc_xmodem_update(recv_crc, data[i]);
+        }
+#endif
+        recv_ptr[recv_cnt++] = data[i++];
+        recv_len--;
+
+        if (recv_cnt < header) {
+            continue;
+        }
+        if (recv_chunk->size > SPM_PAGESIZE) {
+            /* Invalid chunk, give up on the whole request */
+            notify(NOTIFY_ERROR, NOTIFY_ERR_CHUNK_SIZE, recv_chunk->page, 0);
+            recv_error = 1;
+            recv_done = 1;
+            recv_len = 0;
+            break;
+        }
+        if (recv_cnt == header + recv_chunk->size + trailer) {
+            trace(TRACE_PAGE_RECEIVED, recv_chunk->page);
+            timing_end(TIMING_RECEIVE);
+            recv_all = 1;
+            recv_cnt = 0;
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Write the chunk completed in recv_collect() to flash, and keep track
+ * of what the ongoing CMD_FWUPDATE_MEMPAGE request has written so far.
+ */
+void
+recv_write(void)
+{
+    uint8_t err;
+#ifdef DEBUG
+    uint8_t i;
+#endif
+
+    recv_all = 0;
+#ifndef LEAN
+    if (recv_window) {
+        if (recv_crc != 0 || recv_chunk->seq >= WINDOW_SIZE) {
+            /* Not written and therefore not acknowledged, the host sends it again */
+            notify(NOTIFY_ERROR, NOTIFY_ERR_CHUNK_CRC, recv_chunk->page, 0);
+            return;
+        }
+        if (recv_chunk == &comp_data && window_ack.acked != (1U << recv_chunk->seq) - 1) {
+            /* A chunk in front of it is missing, and it may refer back into that one */
+            return;
+        }
+    }
+#endif
+    err = program();
+    if (err) {
+        notify(NOTIFY_ERROR, err, recv_chunk->page, 0);
+    } else {
+        notify(NOTIFY_PAGE_DONE, 0, recv_data.page, 0);
+        recv_end = page_address(recv_data.page) + recv_data.size;
+        /* Only written pages count towards the firmware size FINALIZE goes by */
+        if (page_offset(recv_data.page) + recv_data.size > image_len) {
+            image_len = page_offset(recv_data.page) + recv_data.size;
+        }
+#ifndef LEAN
+        if (recv_window) {
+            window_ack.acked |= 1U << recv_chunk->seq;
+        }
+#endif
+    }
+    if (recv_first) {
+        verify_page = recv_data.page;
+        recv_first = 0;
+    }
+
+#ifdef DEBUG
+    uart_print("page ");
+    uart_putint(recv_data.page, 3);
+    uart_print(" addr ");
+    uart_putint(page_address(recv_data.page), 5);
+    uart_print(" with ");
+    uart_putint(recv_data.size, 3);
+    uart_print(" bytes: ");
+
+    for (i = 0; i < SPM_PAGESIZE && i < recv_data.size; i++) {
+        if ((i & 0xf) == 0) {
+            uart_newline();
+        }
+        uart_puthex(recv_data.data[i]);
+        uart_putchar(' ');
+    }
+    uart_newline();
+#endif
 }
 
 /**
@@ -340,24 +1403,33 @@ usbFunctionWrite(uchar *data, uchar len)
  * operation from the host's point of view, and therefore a send operation
  * from the device's point of view).
  *
- * Here, it's sending back the last written memory page so the host can
- * verify that all went okay.
+ * Here, it's sending back the memory pages written in the last transfer
+ * so the host can verify that all went okay, or whatever part of flash
+ * the host requested via CMD_FLASH_READ, or EEPROM via CMD_EEPROM_READ.
  */
 uchar
 usbFunctionRead(uchar *data, uchar len)
 {
     uint8_t i;
-    uint16_t address = ((recv_data.page - 1) << 7) + repl_cnt;
+    uint16_t address = repl_addr + repl_cnt;
 
     if (len > repl_len - repl_cnt) {
         len = repl_len - repl_cnt;
     }
     repl_cnt += len;
+    /* An erase ahead may have started since the previous packet */
+    if (!repl_eeprom) {
+        boot_rww_enable_safe();
+    }
 #ifdef DEBUG
     uart_print("read ");
 #endif
     for (i = 0; i < len; i++) {
-        *data = pgm_read_byte((void *) address++);
+        if (repl_eeprom) {
+            *data = eeprom_read_byte((uint8_t *) address++);
+        } else {
+            *data = pgm_read_byte((void *) address++);
+        }
 #ifdef DEBUG
         uart_puthex(*data);
 #endif
@@ -370,33 +1442,410 @@ usbFunctionRead(uchar *data, uchar len)
     return len;
 }
 
+#ifndef LEAN
+/**
+ * Unpack the received compressed memory page into the page buffer.
+ *
+ * See the format description at the top of this file. Any back reference
+ * pointing outside the already written part of the application, or any
+ * data that would unpack beyond a single memory page is treated as error.
+ *
+ * @return 1 if the page was unpacked successfully, 0 if the data is invalid
+ */
+uint8_t
+decompress(void)
+{
+    uint16_t base = page_offset(comp_data.page);
+    uint8_t *src = comp_data.data;
+    uint8_t *end = src + comp_data.size;
+    uint8_t flags = 0;
+    uint8_t items = 0;
+    uint8_t out = 0;
+
+    recv_data.page = comp_data.page;
+    recv_data.size = 0;
+
+    if (comp_data.size > SPM_PAGESIZE || comp_data.page >= APP_PAGES) {
+        return 0;
+    }
+
+    while (src < end) {
+        if (items == 0) {
+            flags = *src++;
+            items = 8;
+            continue;
+        }
+
+        if (flags & 1) {
+            if (out == SPM_PAGESIZE) {
+                return 0;
+            }
+            recv_data.data[out++] = *src++;
+
+        } else {
+            uint16_t offset;
+            uint16_t from;
+            uint8_t len;
+
+            if (end - src < 2) {
+                return 0;
+            }
+            offset = (((src[0] & 0xf0) << 4) | src[1]) + 1;
+            len = (src[0] & 0x0f) + LZ_MIN_MATCH;
+            src += 2;
+
+            if (offset > base + out || len > SPM_PAGESIZE - out) {
+                return 0;
+            }
+
+            from = base + out - offset;
+            while (len--) {
+                if (from >= base) {
+                    recv_data.data[out] = recv_data.data[from - base];
+                } else {
+                    recv_data.data[out] = pgm_read_byte((void *) (STAGING_ADDR + from));
+                }
+                from++;
+                out++;
+            }
+        }
+
+        flags >>= 1;
+        items--;
+    }
+
+    recv_data.size = out;
+    return 1;
+}
+#endif
+
 /**
  * Write a single memory page to the device's flash.
  *
- * This performs the actual firmware update page by page.
+ * This performs the actual firmware update page by page. Compressed page
+ * data is unpacked first, and if that fails, nothing is written at all.
+ * The host will then notice the mismatch when verifying the page. Same
+ * goes for any page outside the application section, which is ignored
+ * so the bootloader can't overwrite itself.
+ *
+ * Pages already erased ahead via CMD_FWUPDATE_ERASE are written right
+ * away, all others are erased first. The write is only started here.
+ *
+ * @return 0 if the page was written, or one of the NOTIFY_ERR_* values
  */
-void
+uint8_t
 program(void)
 {
-    uint16_t address = (recv_data.page - 1) << 7;
+    uint16_t address;
     uint8_t i;
     uint8_t sreg;
     uint8_t *buf = (uint8_t *) &recv_data.data;
 
+    /* Wait for any ongoing erase ahead, the dictionary is read from flash */
+    boot_rww_enable_safe();
+    timing_spm_poll();
+    /* SPM can't run while a wear counter is written */
+    eeprom_busy_wait();
+
+#ifndef LEAN
+    if (recv_chunk == &comp_data && !decompress()) {
+        return NOTIFY_ERR_DECOMPRESS;
+    }
+#endif
+    if (recv_data.page >= APP_PAGES) {
+        return NOTIFY_ERR_PAGE_RANGE;
+    }
+    address = page_address(recv_data.page);
+
     sreg = SREG;
-    boot_page_erase(address);
-    boot_spm_busy_wait();
+    if (!erased_ahead(recv_data.page)) {
+        trace(TRACE_ERASE_START, recv_data.page);
+        boot_page_erase(address);
+        timing_spm(TIMING_ERASE);
+        wear_mark(address);
+        boot_spm_busy_wait();
+        timing_spm_poll();
+        trace(TRACE_ERASE_END, recv_data.page);
+    }
 
+    trace(TRACE_WRITE_START, recv_data.page);
     for (i = 0; i < recv_data.size; i += 2) {
         uint16_t word = *buf++;
         word += (*buf++) << 8;
         boot_page_fill(address + i, word);
     }
 
+    /*
+     * Don't wait for the write to finish, the next chunk can be received
+     * in the meantime. Everything reading or writing the flash waits for
+     * it first, via boot_rww_enable_safe() or by checking boot_spm_busy().
+     */
     boot_page_write(address);
-    boot_spm_busy_wait();
+    timing_spm(TIMING_WRITE);
+    trace(TRACE_WRITE_END, recv_data.page);
 
     SREG = sreg;
+    return 0;
+}
+
+#ifndef LEAN
+/**
+ * Erase the next memory page pending from a CMD_FWUPDATE_ERASE request.
+ *
+ * Called repeatedly from the main loop. The erase is only started here,
+ * without waiting for it to finish, so the USB communication continues
+ * in the meantime. Anything reading the application flash or writing to
+ * it has to wait for the SPM operation to finish first, which program()
+ * and all the read requests do via boot_rww_enable_safe().
+ */
+void
+erase_ahead(void)
+{
+    while (erase_next < APP_PAGES && !page_bit_get(erase_pending, erase_next)) {
+        erase_next++;
+    }
+    if (erase_next == APP_PAGES || boot_spm_busy() || !eeprom_is_ready()) {
+        return;
+    }
+
+    trace(TRACE_ERASE_AHEAD, erase_next);
+    page_bit_clear(erase_pending, erase_next);
+    page_bit_set(erase_done, erase_next);
+    boot_page_erase(page_address(erase_next));
+    timing_spm(TIMING_ERASE);
+    wear_mark(page_address(erase_next));
+    erase_next++;
+}
+
+/**
+ * Check if the given memory page was erased ahead.
+ *
+ * Either way, the page is about to be written, so it's taken off the
+ * pages to erase ahead, and won't count as erased anymore afterwards.
+ *
+ * @param page Memory page to check
+ * @return 1 if the page is erased already, 0 if it still needs to be erased
+ */
+uint8_t
+erased_ahead(uint16_t page)
+{
+    uint8_t erased = (page_bit_get(erase_done, page) != 0);
+
+    page_bit_clear(erase_done, page);
+    page_bit_clear(erase_pending, page);
+    return erased;
+}
+
+/**
+ * Remember a memory page erase for the wear counter of its block.
+ *
+ * The counter stands for the most worn page of the block, so it's only
+ * increased if the erased page might be that one, i.e. if it was erased
+ * already since the counter was last increased. Otherwise, the page is
+ * just remembered as catching up with the others. Which pages were erased
+ * is only known since startup, so the first erase in a block after that
+ * always counts, as it may well be the most worn page.
+ *
+ * @param address Flash address of the erased memory page
+ */
+void
+wear_mark(uint16_t address)
+{
+    uint16_t page = address / SPM_PAGESIZE;
+    uint8_t block = address / WEAR_BLOCK_SIZE;
+    uint8_t *seen = &wear_seen[page >> 3];
+    uint8_t block_mask = ((1 << WEAR_BLOCK_PAGES) - 1) << ((page & 7) & ~(WEAR_BLOCK_PAGES - 1));
+
+    if (!(*seen & block_mask) || page_bit_get(wear_seen, page)) {
+        *seen &= ~block_mask;
+        page_bit_set(wear_pending, block);
+        if (block < wear_next) {
+            wear_next = block;
+        }
+    }
+    page_bit_set(wear_seen, page);
+}
+
+/**
+ * Add the next pending flash memory block erase to its wear counter in EEPROM.
+ *
+ * Called repeatedly from the main loop, so the counters are written in
+ * between USB requests. As EEPROM writes and SPM operations can't run
+ * at the same time, nothing is written while either one is ongoing.
+ *
+ * Counters are stored as one's complement, so the erased EEPROM reads
+ * as zero erases, and they simply stop once all bits are cleared.
+ */
+void
+wear_flush(void)
+{
+    uint16_t *counter;
+    uint16_t value;
+
+    while (wear_next < WEAR_COUNTERS && !page_bit_get(wear_pending, wear_next)) {
+        wear_next++;
+    }
+    if (wear_next == WEAR_COUNTERS || boot_spm_busy() || !eeprom_is_ready()) {
+        return;
+    }
+
+    page_bit_clear(wear_pending, wear_next);
+    counter = WEAR_ADDR + wear_next;
+    value = eeprom_read_word(counter);
+    if (value > 0) {
+        eeprom_update_word(counter, value - 1);
+    }
+    wear_next++;
+}
+
+/**
+ * Queue a notification for the host.
+ *
+ * Notifications are sent from the main loop one at a time, whenever the
+ * host has picked up the previous one. If the host doesn't keep up, page
+ * notifications are dropped first, so there's always room left for an
+ * error and the final NOTIFY_READY of the ongoing request.
+ *
+ * @param event Notification type, one of the NOTIFY_* values
+ * @param status Error status, one of the NOTIFY_ERR_* values, or 0
+ * @param page Memory page the notification refers to
+ * @param crc CRC32 for NOTIFY_READY, or 0
+ */
+void
+notify(uint8_t event, uint8_t status, uint16_t page, uint32_t crc)
+{
+    notify_t *entry;
+    uint8_t reserved = (event == NOTIFY_READY) ? 0 : (event == NOTIFY_ERROR) ? 1 : 2;
+
+    if (notify_count + reserved >= NOTIFY_ENTRIES) {
+        return;
+    }
+
+    entry = &notify_queue[(notify_head + notify_count) % NOTIFY_ENTRIES];
+    entry->event = event;
+    entry->status = status;
+    entry->page = page;
+    entry->crc = crc;
+    notify_count++;
+}
+
+/**
+ * Send the next queued notification, if the interrupt-IN endpoint is free.
+ */
+void
+notify_send(void)
+{
+    if (notify_count > 0 && usbInterruptIsReady()) {
+        usbSetInterrupt((uchar *) &notify_queue[notify_head], sizeof(notify_t));
+        notify_head = (notify_head + 1) % NOTIFY_ENTRIES;
+        notify_count--;
+    }
+}
+#endif
+
+/**
+ * Calculate the CRC32 of a range of the application flash memory.
+ *
+ * Uses the same CRC32 as zlib, Ethernet and friends (reflected polynomial
+ * 0xedb88320), so the host can just use whatever CRC32 implementation it
+ * has at hand. The calculation is done bit by bit to avoid wasting flash
+ * memory on a lookup table.
+ *
+ * @param address Flash address to start from
+ * @param len Number of bytes to include
+ * @return CRC32 of the given flash memory range
+ */
+uint32_t
+crc32(uint16_t address, uint16_t len)
+{
+    uint32_t crc = 0xffffffff;
+    uint8_t bit;
+
+    for (; len > 0; len--, address++) {
+        crc ^= pgm_read_byte((void *) address);
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+    }
+
+    return ~crc;
+}
+
+#ifdef STAGED
+/**
+ * Copy the firmware from the staging slot over the active application.
+ *
+ * The size and CRC32 of the firmware are taken from the application
+ * state record, which is expected to be marked as committing already.
+ * Once the copy is done and its CRC32 matches, the record is marked as
+ * valid. Copying the same data again does no harm, so an interrupted
+ * commit is just started over on the next startup.
+ */
+void
+commit(void)
+{
+    uint16_t len = eeprom_read_word(&APP_RECORD_ADDR->length);
+    uint16_t address;
+    uint8_t i;
+
+    if (len > APP_SIZE) {
+        len = APP_SIZE;
+    }
+    /* The committing state may still be written */
+    eeprom_busy_wait();
+
+    for (address = 0; address < len; address += SPM_PAGESIZE) {
+        boot_page_erase(address);
+        wear_mark(address);
+        boot_spm_busy_wait();
+        /* Staging slot is in the RWW section as well */
+        boot_rww_enable();
+
+        for (i = 0; i < SPM_PAGESIZE; i += 2) {
+            boot_page_fill(address + i, pgm_read_word((void *) (STAGING_ADDR + address + i)));
+        }
+
+        boot_page_write(address);
+        boot_spm_busy_wait();
+    }
+    boot_rww_enable();
+
+    eeprom_update_byte(&APP_RECORD_ADDR->state,
+            (crc32(0, len) == eeprom_read_dword(&APP_RECORD_ADDR->crc))
+            ? APP_STATE_VALID : APP_STATE_UPDATING);
+}
+#endif
+
+/**
+ * Write the application state record to EEPROM.
+ *
+ * Goes byte by byte with eeprom_update_byte(), which the bootloader has
+ * anyway, instead of pulling in eeprom_update_block() just for this.
+ *
+ * @param record Application state record to write
+ */
+void
+record_update(const app_record_t *record)
+{
+    uint8_t i;
+
+    for (i = 0; i < sizeof(app_record_t); i++) {
+        eeprom_update_byte((uint8_t *) APP_RECORD_ADDR + i, ((const uint8_t *) record)[i]);
+    }
+}
+
+/**
+ * Check if there's a valid application to start.
+ *
+ * See the application state record description at the top of this file.
+ *
+ * @return 1 if the application can be started, 0 if its update was never finalized
+ */
+uint8_t
+app_valid(void)
+{
+    uint8_t app_state = eeprom_read_byte(&APP_RECORD_ADDR->state);
+    return (app_state == APP_STATE_VALID || app_state == APP_STATE_UNKNOWN);
 }
 
 /**
@@ -406,14 +1855,42 @@ program(void)
  * long before main(). This makes sure the watchdog is disabled by
  * the time main() takes over (watchdog itself is enabled as part
  * of resetting the device to the application code)
+ *
+ * Being called before main(), this is also the place to check if the
+ * application requested the bootloader, or the bootloader itself asked
+ * to start the application, as the key is still untouched at this point.
+ * The key is only valid after a watchdog reset, and is cleared right away
+ * so it won't stick around.
  */
 void
 wdt_init(void)
 {
+    boot_requested = ((MCUSR & (1 << WDRF)) && *BOOT_KEY_ADDR == BOOT_KEY);
+    start_requested = ((MCUSR & (1 << WDRF)) && *BOOT_KEY_ADDR == START_KEY);
+    *BOOT_KEY_ADDR = 0;
+
     MCUSR=0;
     wdt_disable();
 }
 
+#ifndef LEAN
+/**
+ * Print the banner and bootloader activation pin state via UART.
+ *
+ * @param bootloader_enabled Bootloader enable pin state
+ */
+void
+print_banner(uint8_t bootloader_enabled)
+{
+    uart_putchar('\f');
+    uart_print((char *) hello_reply.banner);
+    uart_newline();
+    uart_print("Pin state: ");
+    uart_putchar((bootloader_enabled) ? '1' : '0');
+    uart_newline();
+}
+#endif
+
 /*
  * Off we go..
  */
@@ -423,14 +1900,52 @@ main(void)
     uint8_t i;
     uint8_t shutdown_counter = 0;
     uint8_t bootloader_enabled = 0;
-
-    /* Set up LED I/O pin as output, low */
-    PORTB &= ~(_BV(ws2812_pin));
-    DDRB  |= _BV(ws2812_pin);
+    uint8_t idle_timeout = 0;
 
     /* Set up bootloader activation pin as input w/ pullup */
     BOOTLOADER_ENABLE_DDR &= ~(1 << BOOTLOADER_ENABLE_PIN);
     BOOTLOADER_ENABLE_PORT = (1 << BOOTLOADER_ENABLE_PIN);
+    /* Give the pullup a moment to pull the pin high */
+    _delay_us(20);
+
+    /* Read bootloader enable pin state to check if bootloader is enabled */
+    bootloader_enabled = ((BOOTLOADER_ENABLE_PORT_IN & (1 << BOOTLOADER_ENABLE_PIN)) == 0);
+
+#ifdef STAGED
+    /* Finish an interrupted commit first, the staged firmware is still intact */
+    if (eeprom_read_byte(&APP_RECORD_ADDR->state) == APP_STATE_COMMITTING) {
+        commit();
+        while (wear_next < WEAR_COUNTERS) {
+            wear_flush();
+        }
+    }
+#endif
+
+    /*
+     * Check input port if Bootloader button is pressed, and stay in the
+     * bootloader also if the application requested it, or if the last
+     * firmware update was never finalized. The pin is ignored if the
+     * bootloader reset itself after an idle timeout.
+     *
+     * If neither is the case, jump to the application right away, before
+     * touching anything else. The application sets up the LEDs and all
+     * by itself anyway, and nothing's changed the interrupt vector yet.
+     */
+    if ((!bootloader_enabled || start_requested) && !boot_requested && app_valid()) {
+#ifdef DEBUG
+        uart_init(UART_BRATE_9600_12MHZ);
+        print_banner(bootloader_enabled);
+        uart_newline();
+        /* Delay a moment so UART can finish its output */
+        _delay_ms(1);
+#endif
+        asm("jmp 0000");
+    }
+
+#ifndef LEAN
+    /* Set up LED I/O pin as output, low */
+    PORTB &= ~(_BV(ws2812_pin));
+    DDRB  |= _BV(ws2812_pin);
 
     /* Turn off all LEDs */
     for (i = 0; i < NUM_LEDS; i++) {
@@ -439,37 +1954,22 @@ main(void)
         leds[i].b = 0;
     }
     ws2812_sendarray((uint8_t *) leds, NUM_LEDS * 3);
+#endif
 
     /* Shift interrupt vector to bootloader space */
     MCUCR = (1 << IVCE);
     MCUCR = (1 << IVSEL);
 
-    /* Read bootloader enable pin state to check if bootloader is enabled */
-    bootloader_enabled = ((BOOTLOADER_ENABLE_PORT_IN & (1 << BOOTLOADER_ENABLE_PIN)) == 0);
-
-    /* Print banner and bootloader activation pin state */
+#ifndef LEAN
+    /* Yep, bootloader activated */
     uart_init(UART_BRATE_9600_12MHZ);
-    uart_putchar('\f');
-    uart_print((char *) banner);
-    uart_newline();
-    uart_print("Pin state: ");
-    uart_putchar((bootloader_enabled) ? '1' : '0');
-    uart_newline();
-    
-    /* Check input port if Bootloader button is pressed */
-    if (!bootloader_enabled) {
-        uart_newline();
+    print_banner(bootloader_enabled);
 
-        /* Nope. Put interrupt vector back in order... */
-        MCUCR = (1 << IVCE);
-        MCUCR = 0;
-        /* ...delay a moment so UART can finish its output... */
-        _delay_ms(1);
-        /* ...and jump to application */
-        asm("jmp 0000");
+    if (boot_requested) {
+        uart_print("Requested by application\r\n");
+    } else if (!bootloader_enabled) {
+        uart_print("No valid application\r\n");
     }
-
-    /* Yep, bootloader activated */
     uart_print("Welcome\r\n");
 
     /* Turn first LED on */
@@ -477,40 +1977,72 @@ main(void)
     leds[0].g = 0x10;
     leds[0].b = 0x20;
     ws2812_sendarray((uint8_t *) leds, 3);
+#endif
 
     /* Force USB re-enumeration and set it up */
     usbDeviceDisconnect();
     _delay_ms(300);
     usbDeviceConnect();
     usbInit();
+    trace_init();
+    timing_init();
+#if IDLE_TIMEOUT > 0
+    /* Timer0 only serves as idle timer, its overflow flag is polled in the main loop */
+    TCCR0B = (1 << CS02) | (1 << CS00);
+#endif
 
     sei();
 
     /* Get going */
     while (1) {
         usbPoll();
+        uart_poll();
+        notify_send();
+        wear_flush();
+        timing_spm_poll();
+#if IDLE_TIMEOUT > 0
+        /*
+         * If nobody talks to the bootloader for long enough, e.g. because
+         * the enable pin was held during power-up but there's no host, start
+         * the application if there's a valid one, so the LEDs won't stay dark.
+         */
+        if (TIFR0 & (1 << TOV0)) {
+            TIFR0 = (1 << TOV0);
+            if (++idle_ticks >= IDLE_TIMEOUT * IDLE_TICKS_PER_SECOND &&
+                    state != ST_RESET && app_valid())
+            {
+                uart_print("Idle timeout\r\n");
+                idle_timeout = 1;
+                break;
+            }
+        }
+#endif
         if (state == ST_FWUPDATE) {
+#ifndef LEAN
             if (recv_all) {
-#ifdef DEBUG
-                uart_print("page ");
-                uart_putint(recv_data.page, 2);
-                uart_print(" addr ");
-                uart_putint((recv_data.page - 1) << 7, 5);
-                uart_print(" with ");
-                uart_putint(recv_data.size, 3);
-                uart_print(" bytes: ");
-                
-                for (i = 0; i < SPM_PAGESIZE && i < recv_data.size; i++) {
-                    if ((i & 0xf) == 0) {
-                        uart_newline();
-                    }
-                    uart_puthex(recv_data.data[i]);
-                    uart_putchar(' ');
+                uint8_t used;
+
+                recv_write();
+                /* Carry on with the rest of the packet, and let the host go on once it's taken */
+                used = recv_collect(recv_rest + recv_rest_pos, recv_rest_len);
+                recv_rest_pos += used;
+                recv_rest_len -= used;
+                if (!recv_all) {
+                    usbEnableAllRequests();
+                    timing_end(TIMING_HOLD);
                 }
-                uart_newline();
-#endif
-                recv_all = 0;
             }
+            /* Windows are acknowledged via CMD_FWUPDATE_ACK instead */
+            if (recv_done && !recv_window) {
+                uint16_t start = page_address(verify_page);
+
+                boot_rww_enable_safe();
+                notify(NOTIFY_READY, 0, recv_data.page,
+                        crc32(start, (recv_end > start) ? recv_end - start : 0));
+            }
+            recv_done = 0;
+#endif
+            erase_ahead();
 
         } else if (state == ST_RESET) {
             /*
@@ -522,15 +2054,43 @@ main(void)
                 break;
             }
         } else {
-            _delay_ms(10);
+            /*
+             * Nothing to do but wait for the host, but keep the UART going
+             * meanwhile. A character takes ~1ms to go out at 9600 baud, so
+             * checking for the next one once every millisecond keeps up.
+             */
+            for (i = 0; i < 10; i++) {
+                uart_poll();
+                _delay_ms(1);
+            }
         }
     }
 
     usbDeviceDisconnect();
+    uart_flush();
+
+#ifndef LEAN
+    /* Count whatever erases are still pending before leaving */
+    while (wear_next < WEAR_COUNTERS) {
+        wear_flush();
+    }
+#endif
+    /* The application can only run once the last write or erase is done */
+    boot_rww_enable_safe();
 
     cli();
     MCUCR = (1 << IVCE);
     MCUCR = 0;
+
+    /*
+     * Leave via watchdog reset either way, so the application finds USB,
+     * UART, timers and I/O pins just like after power-up. A reset would end
+     * up in the bootloader again if the enable pin is still held though, so
+     * after an idle timeout, ask it to start the application right away.
+     */
+    if (idle_timeout) {
+        *BOOT_KEY_ADDR = START_KEY;
+    }
     wdt_enable(WDTO_60MS);
     while (1);
 }
@@ -0,0 +1,137 @@
+/*
+ * Ledmacher Bootloader - Timing Histograms
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <string.h>
+#include <avr/boot.h>
+#include <avr/io.h>
+#include "timing.h"
+
+#ifdef TIMING
+
+/** No SPM operation is measured */
+#define TIMING_NONE 0xff
+
+timing_buffer_t timing_buffer = {
+    .phases = TIMING_PHASES,
+    .buckets = TIMING_BUCKETS,
+};
+
+/** Timer1 value at the start of each phase's ongoing measurement */
+static uint16_t timing_started[TIMING_PHASES];
+/** Phase of the measured SPM operation, or TIMING_NONE */
+static uint8_t timing_spm_phase = TIMING_NONE;
+
+
+/**
+ * Start the Timer1 for the measurements.
+ */
+void
+timing_init(void)
+{
+    TCCR1A = 0;
+    TCCR1B = (1 << CS12); /* clk/256 */
+}
+
+
+/**
+ * Clear all histograms.
+ */
+void
+timing_reset(void)
+{
+    memset(timing_buffer.histogram, 0, sizeof(timing_buffer.histogram));
+    timing_spm_phase = TIMING_NONE;
+}
+
+
+/**
+ * Start measuring the given phase.
+ *
+ * @param phase Phase to measure, one of the TIMING_* values
+ */
+void
+timing_start(uint8_t phase)
+{
+    timing_started[phase] = TCNT1;
+}
+
+
+/**
+ * Stop measuring the given phase, and add the duration to its histogram.
+ *
+ * Durations are taken modulo 2^16 ticks, so anything longer than a Timer1
+ * overflow period, ~1.4 seconds, is counted too short.
+ *
+ * @param phase Phase to measure, one of the TIMING_* values
+ */
+void
+timing_end(uint8_t phase)
+{
+    timing_histogram_t *histogram = &timing_buffer.histogram[phase];
+    uint16_t duration = TCNT1 - timing_started[phase];
+    uint16_t rest = duration;
+    uint8_t bucket = 0;
+
+    while (rest > 0 && bucket < TIMING_BUCKETS - 1) {
+        rest >>= 1;
+        bucket++;
+    }
+
+    histogram->count[bucket]++;
+    histogram->total += duration;
+    if (duration > histogram->max) {
+        histogram->max = duration;
+    }
+}
+
+
+/**
+ * Start measuring an SPM operation that was just started.
+ *
+ * @param phase TIMING_ERASE or TIMING_WRITE
+ */
+void
+timing_spm(uint8_t phase)
+{
+    /* The previous operation is done by now, in case nobody polled since */
+    if (timing_spm_phase != TIMING_NONE) {
+        timing_end(timing_spm_phase);
+    }
+    timing_start(phase);
+    timing_spm_phase = phase;
+}
+
+
+/**
+ * Stop measuring the ongoing SPM operation if it is done.
+ */
+void
+timing_spm_poll(void)
+{
+    if (timing_spm_phase != TIMING_NONE && !boot_spm_busy()) {
+        timing_end(timing_spm_phase);
+        timing_spm_phase = TIMING_NONE;
+    }
+}
+
+#endif /* TIMING */
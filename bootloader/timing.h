@@ -0,0 +1,139 @@
+/*
+ * Ledmacher Bootloader - Timing Histograms
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _TIMING_H_
+#define _TIMING_H_
+#include <stdint.h>
+
+/*
+ * Timing histograms
+ *
+ * When built with -DTIMING (make timing), the bootloader measures how long
+ * each memory page erase and write takes until the SPM operation is done,
+ * how long each chunk takes to arrive over USB, and how long the host is
+ * held off with NAKs while a chunk is written. Each duration is counted in
+ * Timer1 ticks, just like the event trace timestamps, and added to the
+ * phase's histogram, which the host can read via CMD_TIMING and print with
+ * timing.py. The histograms are cleared with every CMD_FWUPDATE_INIT, so
+ * they always cover the last firmware update. Without TIMING, all of this
+ * turns into nothing.
+ *
+ * Unlike the trace buffer, the histograms never run out of space, so they
+ * tell whether a whole update is bound by the bus or by the flash memory:
+ * if the host is hardly ever held off, the bus is the bottleneck.
+ */
+
+/** Phase: memory page erase, from starting it until SPM is done */
+#define TIMING_ERASE    0
+/** Phase: memory page write, from starting it until SPM is done */
+#define TIMING_WRITE    1
+/** Phase: chunk reception, from its first to its last byte */
+#define TIMING_RECEIVE  2
+/** Phase: host held off with NAKs until a received chunk is written */
+#define TIMING_HOLD     3
+/** Number of measured phases */
+#define TIMING_PHASES   4
+
+#ifdef TIMING
+/**
+ * Number of histogram buckets. Bucket 0 counts durations of 0 ticks,
+ * bucket n durations from 2^(n-1) up to 2^n - 1 ticks, and the last
+ * bucket everything from there on.
+ */
+#define TIMING_BUCKETS  16
+
+/** Histogram of a single phase */
+typedef struct {
+    /** Number of durations in each bucket */
+    uint16_t count[TIMING_BUCKETS];
+    /** Longest duration so far in ticks */
+    uint16_t max;
+    /** Sum of all durations in ticks */
+    uint32_t total;
+} timing_histogram_t;
+
+/** Timing histograms, sent as-is as response to CMD_TIMING */
+typedef struct {
+    /** Number of phases, TIMING_PHASES */
+    uint8_t phases;
+    /** Number of buckets in each histogram, TIMING_BUCKETS */
+    uint8_t buckets;
+    /** Histograms, indexed by the TIMING_* phase values */
+    timing_histogram_t histogram[TIMING_PHASES];
+} timing_buffer_t;
+
+/** The timing histograms */
+extern timing_buffer_t timing_buffer;
+
+/**
+ * Start the Timer1 for the measurements.
+ */
+void timing_init(void);
+
+/**
+ * Clear all histograms.
+ */
+void timing_reset(void);
+
+/**
+ * Start measuring the given phase.
+ *
+ * @param phase Phase to measure, one of the TIMING_* values
+ */
+void timing_start(uint8_t phase);
+
+/**
+ * Stop measuring the given phase, and add the duration to its histogram.
+ *
+ * @param phase Phase to measure, one of the TIMING_* values
+ */
+void timing_end(uint8_t phase);
+
+/**
+ * Start measuring an SPM operation that was just started.
+ *
+ * Its end is taken by timing_spm_poll() once SPM isn't busy anymore, or
+ * at the latest when the next SPM operation starts.
+ *
+ * @param phase TIMING_ERASE or TIMING_WRITE
+ */
+void timing_spm(uint8_t phase);
+
+/**
+ * Stop measuring the ongoing SPM operation if it is done.
+ *
+ * Called from the main loop and right after waiting for SPM, so the end
+ * is taken before anything else gets in between.
+ */
+void timing_spm_poll(void);
+
+#else
+#define timing_init()
+#define timing_reset()
+#define timing_start(phase)
+#define timing_end(phase)
+#define timing_spm(phase)
+#define timing_spm_poll()
+#endif /* TIMING */
+
+#endif /* _TIMING_H_ */
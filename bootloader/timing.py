@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Bootloader - Timing Histograms
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Reads the timing histograms from a Ledmacher Bootloader built with the
+# timing Makefile target, and prints how long the memory page erases and
+# writes, the chunk reception and holding off the host took during the
+# last firmware update (see timing.h).
+#
+# Usage
+#   ./timing.py [<dump file>]
+#
+# Without a file, the histograms are read from the connected device via
+# CMD_TIMING, which requires pyusb. The raw histograms are also written to
+# timing.bin then, so they can be printed again later on by passing it as
+# dump file.
+#
+# The histograms are cleared when a firmware update is initialized, so
+# read them right after the update, before resetting the device.
+#
+
+import struct
+import sys
+
+
+USB_VENDOR_ID = 0x1209
+USB_DEVICE_ID = 0xb00b
+USB_RECV = 0xc0
+CMD_TIMING = 0x31
+MAX_SIZE = 1024
+
+# Timer1 runs with a prescaler of 256 at 12MHz
+TICK_US = 256 / 12.0
+
+PHASE_NAMES = ["erase", "write", "receive", "hold"]
+TIMING_ERASE = 0
+TIMING_WRITE = 1
+TIMING_RECEIVE = 2
+TIMING_HOLD = 3
+
+
+def read_device():
+    """
+    Read the raw timing histograms from the connected device.
+    """
+    import usb.core
+
+    device = usb.core.find(idVendor=USB_VENDOR_ID, idProduct=USB_DEVICE_ID)
+    if device is None:
+        print("ERROR: no Ledmacher Bootloader device found", file=sys.stderr)
+        sys.exit(1)
+
+    return bytes(device.ctrl_transfer(USB_RECV, CMD_TIMING, 0, 0, MAX_SIZE))
+
+
+def decode(data):
+    """
+    Decode the raw timing histograms into a list of (counts, max, total)
+    tuples per phase, with max and total in us.
+    """
+    phases, buckets = struct.unpack_from('<BB', data)
+    histogram_format = '<{}HHI'.format(buckets)
+    histogram_size = struct.calcsize(histogram_format)
+    if len(data) != 2 + phases * histogram_size:
+        raise ValueError("unexpected timing histograms size {}".format(len(data)))
+
+    histograms = []
+    for phase in range(phases):
+        values = struct.unpack_from(histogram_format, data, 2 + phase * histogram_size)
+        histograms.append((list(values[:buckets]), values[buckets] * TICK_US,
+                           values[buckets + 1] * TICK_US))
+    return histograms
+
+
+def bucket_range(bucket, buckets):
+    """
+    Get the duration range in us the given bucket counts, see TIMING_BUCKETS.
+    """
+    if bucket == 0:
+        return "0"
+    low = (1 << (bucket - 1)) * TICK_US
+    if bucket == buckets - 1:
+        return "{:.0f}-".format(low)
+    return "{:.0f}-{:.0f}".format(low, ((1 << bucket) - 1) * TICK_US)
+
+
+def print_histograms(histograms):
+    """
+    Print each phase's histogram along with its summary.
+    """
+    for phase, (counts, longest, total) in enumerate(histograms):
+        name = PHASE_NAMES[phase] if phase < len(PHASE_NAMES) else "phase {}".format(phase)
+        count = sum(counts)
+        print("{}: {} times, mean {:.0f}us, max {:.0f}us, total {:.0f}us".format(
+            name, count, total / count if count else 0, longest, total))
+
+        for bucket, bucket_count in enumerate(counts):
+            if bucket_count > 0:
+                print("  {:>13s}us {:5d} {}".format(bucket_range(bucket, len(counts)),
+                      bucket_count, "#" * max(1, 50 * bucket_count // count)))
+        print("")
+
+
+def print_bound(histograms):
+    """
+    Tell whether the update was bound by the bus or by the flash memory.
+
+    While the host is held off, it waits for a chunk to be written, so the
+    more of the time that takes compared to receiving chunks, the more the
+    flash memory is the bottleneck.
+    """
+    if len(histograms) <= TIMING_HOLD:
+        return
+
+    receive = histograms[TIMING_RECEIVE][2]
+    hold = histograms[TIMING_HOLD][2]
+    if receive + hold == 0:
+        print("no chunks received")
+        return
+
+    share = 100.0 * hold / (receive + hold)
+    print("host held off {:.1f}% of the time, {}".format(
+        share, "flash-bound" if share >= 50 else "bus-bound"))
+
+
+def main():
+    if len(sys.argv) > 2:
+        print("Usage: {} [<dump file>]".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    if len(sys.argv) == 2:
+        with open(sys.argv[1], 'rb') as dumpfile:
+            data = dumpfile.read()
+    else:
+        data = read_device()
+        with open('timing.bin', 'wb') as dumpfile:
+            dumpfile.write(data)
+
+    histograms = decode(data)
+    print_histograms(histograms)
+    print_bound(histograms)
+
+
+if __name__ == '__main__':
+    main()
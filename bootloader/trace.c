@@ -0,0 +1,66 @@
+/*
+ * Ledmacher Bootloader - Event Trace
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <avr/io.h>
+#include "trace.h"
+
+#ifdef TRACE
+
+/** Trace buffer index mask */
+#define TRACE_ENTRIES_MASK (TRACE_ENTRIES - 1)
+
+trace_buffer_t trace_buffer;
+
+
+/**
+ * Start the Timer1 for the trace event timestamps.
+ */
+void
+trace_init(void)
+{
+    TCCR1A = 0;
+    TCCR1B = (1 << CS12); /* clk/256 */
+}
+
+
+/**
+ * Record an event in the trace buffer.
+ *
+ * Only called from within usbPoll() context, so no need to worry about
+ * any interrupts interfering here.
+ *
+ * @param event Event type, one of the TRACE_* values
+ * @param arg Event specific argument
+ */
+void
+trace(uint8_t event, uint16_t arg)
+{
+    trace_entry_t *entry = &trace_buffer.entries[trace_buffer.count & TRACE_ENTRIES_MASK];
+
+    entry->event = event;
+    entry->arg = arg;
+    entry->time = TCNT1;
+    trace_buffer.count++;
+}
+
+#endif /* TRACE */
@@ -0,0 +1,103 @@
+/*
+ * Ledmacher Bootloader - Event Trace
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+#include <stdint.h>
+
+/*
+ * Binary event trace
+ *
+ * When built with -DTRACE (make trace), the bootloader records events
+ * along with a Timer1 timestamp into a ring buffer in SRAM, which the
+ * host can read via CMD_TRACE and decode with trace.py to see where the
+ * time goes during a firmware update. Without TRACE, all of this turns
+ * into nothing.
+ *
+ * Timer1 runs freely with a prescaler of 256, so one tick is 21.33us at
+ * 12MHz, and the 16-bit timestamp wraps around every ~1.4 seconds.
+ */
+
+/** USB setup request received, argument is the request number */
+#define TRACE_SETUP         0x01
+/** Memory page chunk completely received, argument is the page number */
+#define TRACE_PAGE_RECEIVED 0x02
+/** Memory page erase started, argument is the page number */
+#define TRACE_ERASE_START   0x03
+/** Memory page erase finished, argument is the page number */
+#define TRACE_ERASE_END     0x04
+/** Memory page buffer filled and write issued, i.e. the end of the blocking part, argument is the page number */
+#define TRACE_WRITE_END     0x05
+/** Memory page buffer filling started, argument is the page number */
+#define TRACE_WRITE_START   0x06
+/** Memory page erase ahead started, argument is the page number */
+#define TRACE_ERASE_AHEAD   0x07
+
+#ifdef TRACE
+/** Number of events kept in the trace buffer, must be a power of 2 */
+#define TRACE_ENTRIES 128
+
+/** Single trace event */
+typedef struct {
+    /** Event type, one of the TRACE_* values */
+    uint8_t event;
+    /** Event specific argument, e.g. a 16-bit memory page number */
+    uint16_t arg;
+    /** Timer1 value at the time of the event */
+    uint16_t time;
+} trace_entry_t;
+
+/** Trace buffer, sent as-is as response to CMD_TRACE */
+typedef struct {
+    /**
+     * Total number of events recorded so far. As the entry count is a
+     * power of 2, the next event goes to index (count % TRACE_ENTRIES),
+     * which lets the host put the entries back in order.
+     */
+    uint16_t count;
+    /** Ring buffer of the last TRACE_ENTRIES events */
+    trace_entry_t entries[TRACE_ENTRIES];
+} trace_buffer_t;
+
+/** The trace buffer */
+extern trace_buffer_t trace_buffer;
+
+/**
+ * Start the Timer1 for the trace event timestamps.
+ */
+void trace_init(void);
+
+/**
+ * Record an event in the trace buffer.
+ *
+ * @param event Event type, one of the TRACE_* values
+ * @param arg Event specific argument
+ */
+void trace(uint8_t event, uint16_t arg);
+
+#else
+#define trace_init()
+#define trace(event, arg)
+#endif /* TRACE */
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Bootloader - Event Trace Decoder
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Reads the event trace buffer from a Ledmacher Bootloader built with the
+# trace Makefile target, and decodes it into a per-page timeline showing
+# where the time goes during a firmware update (see trace.h).
+#
+# Usage
+#   ./trace.py [<dump file>]
+#
+# Without a file, the trace buffer is read from the connected device via
+# CMD_TRACE, which requires pyusb. The raw buffer is also written to
+# trace.bin then, so it can be decoded again later on by passing it as
+# dump file.
+#
+# Note, the buffer only holds the most recent events, so best read it
+# right after a firmware update, before resetting the device.
+#
+
+import struct
+import sys
+
+
+USB_VENDOR_ID = 0x1209
+USB_DEVICE_ID = 0xb00b
+USB_RECV = 0xc0
+CMD_TRACE = 0x30
+MAX_ENTRIES = 1024
+
+# Trace entry layout, see trace_entry_t in trace.h
+ENTRY_FORMAT = '<BHH'
+ENTRY_SIZE = struct.calcsize(ENTRY_FORMAT)
+
+# Timer1 runs with a prescaler of 256 at 12MHz
+TICK_US = 256 / 12.0
+
+TRACE_SETUP = 0x01
+TRACE_PAGE_RECEIVED = 0x02
+TRACE_ERASE_START = 0x03
+TRACE_ERASE_END = 0x04
+TRACE_WRITE_END = 0x05
+TRACE_WRITE_START = 0x06
+TRACE_ERASE_AHEAD = 0x07
+
+EVENT_NAMES = {
+    TRACE_SETUP: "setup",
+    TRACE_PAGE_RECEIVED: "received",
+    TRACE_ERASE_START: "erase start",
+    TRACE_ERASE_END: "erase end",
+    TRACE_WRITE_END: "write issued",
+    TRACE_WRITE_START: "write start",
+    TRACE_ERASE_AHEAD: "erase ahead",
+}
+
+REQUEST_NAMES = {
+    0x01: "HELLO",
+    0x10: "INIT",
+    0x11: "MEMPAGE",
+    0x12: "VERIFY",
+    0x13: "FINALIZE",
+    0x14: "CRC",
+    0x15: "FLASH_READ",
+    0x16: "ERASE",
+    0x17: "WEAR_READ",
+    0x18: "ACK",
+    0x20: "EEPROM_READ",
+    0x21: "EEPROM_WRITE",
+    0x30: "TRACE",
+    0x31: "TIMING",
+    0xf0: "BYE",
+    0xfa: "RESET",
+}
+
+
+def read_device():
+    """
+    Read the raw trace buffer from the connected device.
+    """
+    import usb.core
+
+    device = usb.core.find(idVendor=USB_VENDOR_ID, idProduct=USB_DEVICE_ID)
+    if device is None:
+        print("ERROR: no Ledmacher Bootloader device found", file=sys.stderr)
+        sys.exit(1)
+
+    return bytes(device.ctrl_transfer(USB_RECV, CMD_TRACE, 0, 0, 2 + ENTRY_SIZE * MAX_ENTRIES))
+
+
+def decode(data):
+    """
+    Decode the raw trace buffer into a list of (event, arg, time in us) tuples.
+
+    The entries are put back in order, and the 16-bit timestamps are unwrapped
+    assuming there's never more than one timer overflow between two events.
+    """
+    count = struct.unpack_from('<H', data)[0]
+    size = (len(data) - 2) // ENTRY_SIZE
+    if size == 0 or size & (size - 1) or 2 + size * ENTRY_SIZE != len(data):
+        raise ValueError("unexpected trace buffer size {}".format(len(data)))
+
+    num = min(count, size)
+    entries = []
+    for i in range(count - num, count):
+        entries.append(struct.unpack_from(ENTRY_FORMAT, data, 2 + (i % size) * ENTRY_SIZE))
+
+    events = []
+    ticks = 0
+    last = None
+    for event, arg, time in entries:
+        if last is not None:
+            ticks += (time - last) & 0xffff
+        last = time
+        events.append((event, arg, ticks * TICK_US))
+    return events
+
+
+def print_events(events):
+    """
+    Print the plain list of events with their timestamps.
+    """
+    for event, arg, time in events:
+        name = EVENT_NAMES.get(event, "0x{:02x}".format(event))
+        if event == TRACE_SETUP:
+            arg = REQUEST_NAMES.get(arg, "0x{:02x}".format(arg))
+        print("{:10.0f}us  {:12s} {}".format(time, name, arg))
+
+
+def print_pages(events):
+    """
+    Print the per-page timeline, i.e. for each written page the time spent
+    on receiving it (since the previous page was written), unpacking it
+    (time between receiving and erasing or writing, including waiting for
+    the previous page's write), erasing it, and filling the page buffer.
+    The write itself finishes in the background while the next page is
+    received. Pages erased ahead via CMD_FWUPDATE_ERASE show no erase time,
+    as that happened in the background while waiting for the data.
+    """
+    print("")
+    print("page   receive   unpack    erase     fill  (all in us)")
+
+    totals = [0, 0, 0, 0]
+    last_end = None
+    received = erase_start = erase_end = write_start = None
+
+    for event, arg, time in events:
+        if event == TRACE_SETUP and arg == 0x11 and last_end is None:
+            last_end = time
+        elif event == TRACE_PAGE_RECEIVED:
+            received = time
+            erase_start = erase_end = write_start = None
+        elif event == TRACE_ERASE_START:
+            erase_start = time
+        elif event == TRACE_ERASE_END:
+            erase_end = time
+        elif event == TRACE_WRITE_START:
+            write_start = time
+        elif event == TRACE_WRITE_END and None not in (last_end, received, write_start):
+            if None in (erase_start, erase_end):
+                erase_start = erase_end = write_start
+            times = [received - last_end, erase_start - received,
+                     erase_end - erase_start, time - write_start]
+            totals = [a + b for a, b in zip(totals, times)]
+            print("{:4d} {:9.0f} {:8.0f} {:8.0f} {:8.0f}".format(arg, *times))
+            last_end = time
+
+    print("total {:8.0f} {:8.0f} {:8.0f} {:8.0f}".format(*totals))
+
+
+def main():
+    if len(sys.argv) > 2:
+        print("Usage: {} [<dump file>]".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    if len(sys.argv) == 2:
+        with open(sys.argv[1], 'rb') as dumpfile:
+            data = dumpfile.read()
+    else:
+        data = read_device()
+        with open('trace.bin', 'wb') as dumpfile:
+            dumpfile.write(data)
+
+    events = decode(data)
+    print_events(events)
+    print_pages(events)
+
+
+if __name__ == '__main__':
+    main()
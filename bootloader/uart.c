@@ -22,9 +22,45 @@
  * SOFTWARE.
  */
 #include <avr/io.h>
-#include <avr/interrupt.h>
 #include "uart.h"
 
+#ifndef LEAN
+/*
+ * Transmitted data is written into a ring buffer that is drained from
+ * the main loop via uart_poll(), so printing doesn't have to wait for
+ * each character to go out at whatever slow baud rate is used.
+ *
+ * There's deliberately no UART interrupt involved: V-USB needs its own
+ * interrupt to be served within a few cycles, and the data register
+ * empty interrupt would add its prologue and epilogue to that latency.
+ * At 9600 baud, a character takes about 1ms to go out. The main loop
+ * comes around a lot more often than that during a firmware update, and
+ * polls at least once a millisecond while it's waiting for the host, so
+ * the buffer is drained at line rate either way.
+ *
+ * If the buffer is full while interrupts are enabled, the character is
+ * dropped and counted as overflow instead of waiting for space, so any
+ * output never stalls the USB communication or flashing. With interrupts
+ * disabled, i.e. before the main loop is running or after it's left, the
+ * character is simply written out directly, the same way it was done
+ * before.
+ */
+#ifndef UART_TX_BUFFER_SIZE
+/** UART transmit buffer size, must be a power of 2 */
+#define UART_TX_BUFFER_SIZE 64
+#endif
+/** UART transmit buffer index mask */
+#define UART_TX_BUFFER_MASK (UART_TX_BUFFER_SIZE - 1)
+
+/** UART transmit ring buffer */
+static char tx_buffer[UART_TX_BUFFER_SIZE];
+/** Transmit buffer write index, only changed by uart_putchar() */
+static uint8_t tx_head;
+/** Transmit buffer read index, only changed by tx_next() */
+static uint8_t tx_tail;
+/** Number of characters dropped due to a full transmit buffer */
+static uint16_t tx_overflows;
+
 
 /**
  * Initialize UART with given baud rate value.
@@ -57,6 +93,32 @@ uart_init(int16_t brate)
 }
 
 
+/**
+ * Write the oldest character in the transmit buffer to the UART data
+ * register. Expects the data register to be empty and the transmit
+ * buffer to contain data.
+ */
+static void
+tx_next(void)
+{
+    UDR0 = tx_buffer[tx_tail];
+    tx_tail = (tx_tail + 1) & UART_TX_BUFFER_MASK;
+}
+
+
+/**
+ * Send the next buffered character, if the UART data register is empty.
+ * Called repeatedly from the main loop.
+ */
+void
+uart_poll(void)
+{
+    if (tx_head != tx_tail && (UCSR0A & (1 << UDRE0))) {
+        tx_next();
+    }
+}
+
+
 /**
  * Transmit a single character via UART.
  * @param data Character to write
@@ -64,10 +126,50 @@ uart_init(int16_t brate)
 void
 uart_putchar(char data)
 {
-    while (!(UCSR0A & (1 << UDRE0))) {
-        /* wait for empty tx buffer */
+    uint8_t next = (tx_head + 1) & UART_TX_BUFFER_MASK;
+
+    if (!(SREG & (1 << SREG_I))) {
+        /* Interrupts disabled, flush the buffer and write directly */
+        uart_flush();
+        while (!(UCSR0A & (1 << UDRE0))) {
+            /* wait for empty tx buffer */
+        }
+        UDR0 = data;
+        return;
+    }
+
+    if (next == tx_tail) {
+        tx_overflows++;
+        return;
+    }
+
+    tx_buffer[tx_head] = data;
+    tx_head = next;
+}
+
+
+/**
+ * Write all buffered data to the UART data register, waiting for each
+ * character to go out.
+ */
+void
+uart_flush(void)
+{
+    while (tx_head != tx_tail) {
+        uart_poll();
     }
-    UDR0 = data;
+}
+
+
+/**
+ * Get the number of characters dropped due to a full transmit buffer.
+ *
+ * @return Number of dropped characters
+ */
+uint16_t
+uart_overflows(void)
+{
+    return tx_overflows;
 }
 
 
@@ -176,3 +278,5 @@ uart_putint(int32_t number, int8_t digits)
 }
 
 #endif /* DEBUG */
+
+#endif /* LEAN */
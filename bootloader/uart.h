@@ -31,6 +31,17 @@
 #define UART_BRATE_38400_12MHZ  19
 #define UART_BRATE_57600_12MHZ  12
 
+#ifdef LEAN
+/* No UART output at all in the lean bootloader build */
+#define uart_init(brate)
+#define uart_putchar(data)
+#define uart_poll()
+#define uart_flush()
+#define uart_overflows() 0
+#define uart_newline()
+#define uart_print(data)
+#else
+
 /**
  * Initialize UART with given baud rate value.
  * See list of UART_BRATE_* defines for some predefined baud rate values.
@@ -45,6 +56,24 @@ void uart_init(int16_t brate);
  */
 void uart_putchar(char data);
 
+/**
+ * Send the next buffered character, if the UART data register is empty.
+ * Called repeatedly from the main loop.
+ */
+void uart_poll(void);
+
+/**
+ * Write all buffered data to the UART data register, waiting for each
+ * character to go out.
+ */
+void uart_flush(void);
+
+/**
+ * Get the number of characters dropped due to a full transmit buffer.
+ * @return Number of dropped characters
+ */
+uint16_t uart_overflows(void);
+
 /**
  * Print a newline via UART.
  */
@@ -79,4 +108,6 @@ void uart_putint(int32_t number, int8_t digits);
 
 #endif /* DEBUG */
 
+#endif /* LEAN */
+
 #endif /* _UART_H_ */
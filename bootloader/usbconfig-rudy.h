@@ -28,7 +28,17 @@
 #define RUDY_INTERFACE_SUBCLASS  0
 #define RUDY_INTERFACE_PROTOCOL  0
 
+#ifdef LEAN
+// no notifications in the lean bootloader build, so no interrupt-IN endpoint either
+#define RUDY_HAVE_INTRIN_ENDPOINT   0
+// and only a single chunk per request, which needs neither long transfers nor flow control
+#define RUDY_LONG_TRANSFERS         0
+#define RUDY_HAVE_FLOWCONTROL       0
+#else
 #define RUDY_HAVE_INTRIN_ENDPOINT   1
+#define RUDY_LONG_TRANSFERS         1
+#define RUDY_HAVE_FLOWCONTROL       1
+#endif
 #define RUDY_HAVE_INTRIN_ENDPOINT3  0
 #define RUDY_INTR_POLL_INTERVAL     10
 
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Bootloader - Flash Wear Report
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Reads the flash wear counters from a connected Ledmacher Bootloader
+# device and prints how often each block of BLOCK_PAGES memory pages was
+# erased so far, i.e. its most worn page, along with the most worn one
+# compared to the rated endurance of the flash memory.
+#
+# Usage
+#   ./wear.py [<warn percent>]
+#
+# Requires pyusb and a bootloader version 1.13 or newer, older ones kept
+# a counter for each page in a different place. Exits with 2 if
+# any page reached the given percentage of the rated endurance (default
+# 80%), so fleet tooling can check for devices close to wearing out.
+#
+# Note, the bootloader updates the counters in between USB requests, so
+# erases from an ongoing firmware update may not show up right away.
+#
+
+import struct
+import sys
+import usb.core
+
+
+USB_VENDOR_ID = 0x1209
+USB_DEVICE_ID = 0xb00b
+USB_SEND = 0x40
+USB_RECV = 0xc0
+
+CMD_HELLO = 0x01
+CMD_WEAR_READ = 0x17
+CMD_BYE = 0xf0
+HELLO_VALUE = 0x4d6f
+HELLO_INDEX = 0x6921
+
+# Capability block offsets, see capabilities_t in main.c
+CAPS_VERSION_MAJOR = 1
+CAPS_VERSION_MINOR = 2
+CAPS_PAGE_SIZE = 3
+CAPS_FEATURES_EXT = 12
+FEATURE_EXT_WEAR = 0x01
+
+# Erase/write endurance of the ATmega328P flash memory
+RATED_CYCLES = 10000
+# Wear counter layout, see WEAR_BLOCK_PAGES and WEAR_COUNTERS in main.c
+BLOCK_PAGES = 4
+COUNTERS = 64
+BLOCKS_PER_LINE = 8
+
+
+def read_counters(device):
+    """
+    Read the wear counters from the given device.
+
+    Returns the list of erase counts per block of memory pages, and the block size.
+    """
+    reply = bytes(device.ctrl_transfer(USB_RECV, CMD_HELLO, HELLO_VALUE, HELLO_INDEX, 128))
+    banner, _, caps = reply.partition(b'\0')
+    print(banner.decode('ascii', 'replace'))
+
+    if len(caps) <= CAPS_FEATURES_EXT or caps[0] <= CAPS_FEATURES_EXT or \
+            not caps[CAPS_FEATURES_EXT] & FEATURE_EXT_WEAR or \
+            (caps[CAPS_VERSION_MAJOR], caps[CAPS_VERSION_MINOR]) < (1, 13):
+        device.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0, None)
+        print("ERROR: bootloader has no wear counters, or an older layout of them", file=sys.stderr)
+        sys.exit(1)
+
+    page_size = struct.unpack_from('<H', caps, CAPS_PAGE_SIZE)[0]
+    data = bytes(device.ctrl_transfer(USB_RECV, CMD_WEAR_READ, 0, 0, 2 * COUNTERS))
+    device.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0, None)
+
+    # Counters are stored as one's complement, so erased EEPROM reads as zero
+    counters = [~value & 0xffff for value in struct.unpack('<{}H'.format(len(data) // 2), data)]
+    return counters, page_size * BLOCK_PAGES
+
+
+def main():
+    if len(sys.argv) > 2:
+        print("Usage: {} [<warn percent>]".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    warn = float(sys.argv[1]) if len(sys.argv) == 2 else 80.0
+
+    device = usb.core.find(idVendor=USB_VENDOR_ID, idProduct=USB_DEVICE_ID)
+    if device is None:
+        print("ERROR: no Ledmacher Bootloader device found", file=sys.stderr)
+        sys.exit(1)
+
+    counters, block_size = read_counters(device)
+
+    for start in range(0, len(counters), BLOCKS_PER_LINE):
+        line = counters[start:start + BLOCKS_PER_LINE]
+        print("0x{:04x}: {}".format(start * block_size, " ".join("{:5d}".format(c) for c in line)))
+
+    worst = max(range(len(counters)), key=lambda block: counters[block])
+    used = 100.0 * counters[worst] / RATED_CYCLES
+    print("")
+    print("total: {} erases counted on {} blocks of {} bytes".format(sum(counters), len(counters), block_size))
+    print("worst: block {} at 0x{:04x}, {} erases, {:.1f}% of rated {} cycles".format(
+        worst, worst * block_size, counters[worst], used, RATED_CYCLES))
+
+    if used >= warn:
+        print("WARNING: flash memory is close to wearing out", file=sys.stderr)
+        sys.exit(2)
+
+
+if __name__ == '__main__':
+    main()
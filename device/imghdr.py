@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# Ledmacher Device Application - Image Header Patcher
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Patches the firmware length and CRC32 into the application image header
+# of a freshly built binary file (see the image_header definition in main.c).
+# Neither of them are known before linking, so this is called from within
+# the Makefile right after the binary file is created.
+#
+# Usage
+#   ./imghdr.py <firmware.bin>
+#
+# The binary file is modified in place.
+#
+
+import struct
+import sys
+import zlib
+
+
+# Image header is placed right after the ATmega328 interrupt vector table
+HEADER_OFFSET = 0x68
+HEADER_FORMAT = '<IH8sI'
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+MAGIC = 0x4d44454c
+
+
+def patch_header(image):
+    """
+    Fill in the length and CRC32 fields of the given firmware image's header.
+
+    Returns the patched image, or None if there's no image header in it.
+    """
+    if len(image) < HEADER_OFFSET + HEADER_SIZE:
+        return None
+
+    magic, _, build_hash, _ = struct.unpack_from(HEADER_FORMAT, image, HEADER_OFFSET)
+    if magic != MAGIC:
+        return None
+
+    crc = zlib.crc32(image[HEADER_OFFSET + HEADER_SIZE:]) & 0xffffffff
+    patched = bytearray(image)
+    struct.pack_into(HEADER_FORMAT, patched, HEADER_OFFSET, magic, len(image), build_hash, crc)
+    return bytes(patched)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: {} <firmware.bin>".format(sys.argv[0]), file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as binfile:
+        image = binfile.read()
+
+    patched = patch_header(image)
+    if patched is None:
+        print("ERROR: no image header found at 0x{:04x}".format(HEADER_OFFSET), file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[1], 'wb') as binfile:
+        binfile.write(patched)
+
+    length, crc = struct.unpack_from('<H8xI', patched, HEADER_OFFSET + 4)
+    print("image header: length {} crc32 {:08x}".format(length, crc))
+
+
+if __name__ == '__main__':
+    main()
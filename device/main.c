@@ -23,17 +23,171 @@
  */
 #include <util/delay.h>
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
 #include "light_ws2812.h"
 #include "created.h"
 
-/** Array of all colors */
-extern struct cRGB colors[];
-/** Number of different colors */
-static const uint8_t num_colors = (sizeof colors / sizeof *colors);
+/*
+ * Application image header
+ *
+ * Placed into the .vectors section, so it ends up right after the
+ * interrupt vector table at a fixed flash address (0x68 on ATmega328).
+ * The bootloader reports it to the host, which can then tell which
+ * build is installed on the device without reading back all of flash.
+ *
+ * The length and CRC32 (over everything following the header) aren't
+ * known at compile time, imghdr.py patches them into the binary file
+ * after linking. The build hash is written to created.h by the backend
+ * build script, local builds simply leave it all zero.
+ */
+/** Magic number at the start of the image header, "LEDM" in ASCII */
+#define IMAGE_MAGIC 0x4d44454cUL
+
+#ifndef BUILD_HASH
+/** Build hash of the backend build, all zero if not built by the backend */
+#define BUILD_HASH { 0 }
+#endif
+
+/** Application image header, must match the one in bootloader/main.c */
+typedef struct {
+    /** Magic number, IMAGE_MAGIC */
+    uint32_t magic;
+    /** Firmware size in bytes, patched after linking */
+    uint16_t length;
+    /** First bytes of the backend build hash */
+    uint8_t build_hash[8];
+    /** CRC32 of the firmware following the header, patched after linking */
+    uint32_t crc;
+} image_header_t;
+
+/** The application image header itself */
+const image_header_t image_header __attribute__((used, section(".vectors"))) = {
+    .magic = IMAGE_MAGIC,
+    .build_hash = BUILD_HASH,
+};
+
+/*
+ * Bootloader request
+ *
+ * Receiving the Finnish greeting "Moi!" via UART (9600 baud 8N1) makes
+ * the application reset into the bootloader, so a firmware update can
+ * be done without anyone pressing the bootloader enable button. The
+ * bootloader is told so via a key in the topmost word in RAM, which
+ * is left alone by the bootloader's startup code.
+ */
+/** UART baud rate register value for 9600 baud at 12MHz */
+#define UART_BRATE_9600_12MHZ 77
+/** Address of the bootloader request key, see bootloader/main.c */
+#define BOOT_KEY_ADDR ((volatile uint16_t *) (RAMEND - 1))
+/** Bootloader request key, must match the one in bootloader/main.c */
+#define BOOT_KEY 0xb007
+/** UART message requesting the bootloader */
+static const char boot_request[] = "Moi!";
+
+/*
+ * Runtime configuration
+ *
+ * The timings and colors can be changed without rebuilding and flashing
+ * the firmware by writing a new configuration to the start of EEPROM
+ * via the bootloader (see bootloader/config.py). If there's no valid
+ * configuration in EEPROM, the values from created.h are used.
+ *
+ * A configuration only applies to the firmware image it was written for,
+ * identified by the CRC32 in its image header, so flashing a different
+ * firmware brings back that firmware's own defaults.
+ */
+/** Magic number at the start of a valid EEPROM configuration, "LC" in ASCII */
+#define CONFIG_MAGIC 0x434c
+/** Maximum number of colors in the configuration */
+#define CONFIG_MAX_COLORS 16
+
+/** Configuration, must match the layout in bootloader/config.py */
+typedef struct {
+    /** Magic number, CONFIG_MAGIC */
+    uint16_t magic;
+    /** CRC32 from the image header of the firmware it was written for, unused in the defaults */
+    uint32_t image_crc;
+    /** Time in milliseconds to stay on a color */
+    uint16_t wait_color_ms;
+    /** Time in milliseconds between two gradient steps */
+    uint16_t wait_gradient_ms;
+    /** Number of steps to get from one color to the next */
+    uint8_t gradient_steps;
+    /** Number of colors */
+    uint8_t num_colors;
+    /** The colors */
+    struct cRGB colors[CONFIG_MAX_COLORS];
+} config_t;
+
+/** EEPROM address of the configuration */
+#define CONFIG_ADDR ((config_t *) 0)
+
+/*
+ * Default configuration
+ *
+ * The values from created.h are kept in a fixed-layout block in flash,
+ * which is used whenever there's no valid configuration in EEPROM. The
+ * backend finds the block via its config_defaults symbol in the linker
+ * map of a prebuilt template firmware, and patches new values straight
+ * into a copy of the template binary instead of compiling the firmware
+ * for every configuration (see backend/template.py).
+ *
+ * The template is built with the template target, which raises MAX_LEDS
+ * so the number of LEDs can be patched in as well.
+ */
+/** Magic number at the start of the default configuration, "LDEF" in ASCII */
+#define DEFAULTS_MAGIC 0x4645444cUL
+
+/** Number of colors in the created.h configuration */
+#define NUM_COLORS (sizeof((struct cRGB[]) COLORS) / sizeof(struct cRGB))
+
+/* The created.h values have to fit into the configuration, the backend rejects all others */
+_Static_assert(NUM_COLORS > 0 && NUM_COLORS <= CONFIG_MAX_COLORS, "COLORS needs 1 to 16 colors");
+_Static_assert(GRADIENT_STEPS > 0 && GRADIENT_STEPS <= 0xff, "GRADIENT_STEPS out of range");
+_Static_assert(WAIT_COLOR_MS <= 0xffff && WAIT_GRADIENT_MS <= 0xffff, "WAIT_*_MS out of range");
+
+#ifndef MAX_LEDS
+/** Maximum number of LEDs, i.e. the size of the LED buffer */
+#define MAX_LEDS NUM_LEDS
+#endif
+
+/** Default configuration, must match the layout in backend/template.py */
+typedef struct {
+    /** Magic number, DEFAULTS_MAGIC */
+    uint32_t magic;
+    /** Maximum number of LEDs the firmware is built for, MAX_LEDS */
+    uint16_t max_leds;
+    /** Number of LEDs */
+    uint16_t num_leds;
+    /** Configuration used if there's none in EEPROM */
+    config_t config;
+} defaults_t;
+
+/** The default configuration itself */
+const defaults_t config_defaults PROGMEM __attribute__((used)) = {
+    .magic = DEFAULTS_MAGIC,
+    .max_leds = MAX_LEDS,
+    .num_leds = NUM_LEDS,
+    .config = {
+        .magic = CONFIG_MAGIC,
+        .wait_color_ms = WAIT_COLOR_MS,
+        .wait_gradient_ms = WAIT_GRADIENT_MS,
+        .gradient_steps = GRADIENT_STEPS,
+        .num_colors = NUM_COLORS,
+        .colors = COLORS,
+    },
+};
+
+/** The active configuration */
+static config_t config;
+/** Number of LEDs */
+static uint16_t num_leds;
 
 /** All the LED's current values */
-static struct cRGB leds[NUM_LEDS];
+static struct cRGB leds[MAX_LEDS];
 /** Gradient target RGB value */
 static struct cRGB gradient;
 /** Gradient step value for each R, G, B component */
@@ -84,11 +238,11 @@ led_value(uint8_t led, uint8_t gradient, uint8_t step)
 /**
  * Get a single gradient step value based on the given current value
  * and the given gradient target value in respect to the configured
- * GRADIENT_STEPS value.
+ * gradient steps value.
  *
  * When setting up a new gradient, this function determines the step
  * value to get from a single R/G/B value to the gradient target value
- * in GRADIENT_STEPS amount of steps.
+ * in the configured amount of steps.
  *
  * @param led Current LED value, starting value for the next gradient
  * @param gradient Target gradient value
@@ -99,10 +253,10 @@ get_step(uint8_t led, uint8_t gradient)
 {
     uint8_t step = 0;
     if (led > gradient) {
-        step = ((led - gradient) / GRADIENT_STEPS);
+        step = ((led - gradient) / config.gradient_steps);
 
     } else if (led < gradient) {
-        step = ((led + gradient) / GRADIENT_STEPS);
+        step = ((led + gradient) / config.gradient_steps);
     } else {
         // do nothing
         return 0;
@@ -119,13 +273,13 @@ get_step(uint8_t led, uint8_t gradient)
 void
 gradient_step(void)
 {
-    uint8_t i;
+    uint16_t i;
 
     uint8_t r = led_value(leds[0].r, gradient.r, step.r);
     uint8_t g = led_value(leds[0].g, gradient.g, step.g);
     uint8_t b = led_value(leds[0].b, gradient.b, step.b);
 
-    for (i = 0; i < NUM_LEDS; i++) {
+    for (i = 0; i < num_leds; i++) {
         leds[i].r = r;
         leds[i].g = g;
         leds[i].b = b;
@@ -157,9 +311,9 @@ check_gradient_process(void)
 void
 next_gradient(void)
 {
-    gradient.r = colors[color_index].r;
-    gradient.g = colors[color_index].g;
-    gradient.b = colors[color_index].b;
+    gradient.r = config.colors[color_index].r;
+    gradient.g = config.colors[color_index].g;
+    gradient.b = config.colors[color_index].b;
 
     step.r = get_step(leds[0].r, gradient.r);
     step.g = get_step(leds[0].g, gradient.g);
@@ -167,25 +321,112 @@ next_gradient(void)
 
     gradient_ongoing = 1;
 
-    if (++color_index == num_colors) {
+    if (++color_index == config.num_colors) {
         color_index = 0;
     }
 }
 
+/**
+ * Load the configuration from EEPROM.
+ *
+ * Falls back to the default configuration in flash if the EEPROM
+ * doesn't contain a valid configuration for this firmware image.
+ */
+void
+config_load(void)
+{
+    num_leds = pgm_read_word(&config_defaults.num_leds);
+    if (num_leds > MAX_LEDS) {
+        num_leds = MAX_LEDS;
+    }
+
+    eeprom_read_block(&config, CONFIG_ADDR, sizeof(config));
+    if (config.magic == CONFIG_MAGIC &&
+            config.image_crc == pgm_read_dword(&image_header.crc) &&
+            config.num_colors > 0 &&
+            config.num_colors <= CONFIG_MAX_COLORS &&
+            config.gradient_steps > 0)
+    {
+        return;
+    }
+
+    memcpy_P(&config, &config_defaults.config, sizeof(config));
+}
+
+/**
+ * Delay for a given number of milliseconds.
+ *
+ * Unlike _delay_ms(), the delay doesn't need to be known at compile time,
+ * which is required for the configuration values read from EEPROM.
+ *
+ * @param ms Number of milliseconds to delay
+ */
+void
+delay_ms(uint16_t ms)
+{
+    while (ms--) {
+        _delay_ms(1);
+    }
+}
+
+/**
+ * Reset into the bootloader.
+ *
+ * Writes the bootloader request key and lets the watchdog reset the
+ * device. Never returns.
+ */
+void
+enter_bootloader(void)
+{
+    cli();
+    *BOOT_KEY_ADDR = BOOT_KEY;
+    wdt_enable(WDTO_15MS);
+    while (1);
+}
+
+/**
+ * UART receive interrupt handler.
+ *
+ * Waits for the bootloader request message and enters the bootloader
+ * once it's received in full.
+ */
+ISR(USART_RX_vect)
+{
+    static uint8_t matched;
+    char data = UDR0;
+
+    if (data == boot_request[matched]) {
+        if (++matched == sizeof(boot_request) - 1) {
+            enter_bootloader();
+        }
+    } else {
+        matched = (data == boot_request[0]);
+    }
+}
+
 /*
  * Main
  */
 int
 main(void)
 {
-    uint8_t i;
+    uint16_t i;
 
     /* Set up LED GPIO */
 	PORTB &= ~(_BV(ws2812_pin));
 	DDRB  |= _BV(ws2812_pin);
 
+    /* Set up UART to receive the bootloader request */
+    UBRR0H = 0;
+    UBRR0L = UART_BRATE_9600_12MHZ;
+    UCSR0C = (1 << UCSZ01) | (1 << UCSZ00); /* 8N1 */
+    UCSR0B = (1 << RXCIE0) | (1 << RXEN0);
+    sei();
+
+    config_load();
+
     /* Default init all LEDs */
-    for (i = 0; i < NUM_LEDS; i++) {
+    for (i = 0; i < num_leds; i++) {
         leds[i].r = 0;
         leds[i].g = 0;
         leds[i].b = 0;
@@ -198,14 +439,14 @@ main(void)
     while (1) {
         if (gradient_ongoing) {
             gradient_step();
-            ws2812_sendarray((uint8_t *) leds, NUM_LEDS * 3);
+            ws2812_sendarray((uint8_t *) leds, num_leds * 3);
             gradient_ongoing = check_gradient_process();
         } else {
-            _delay_ms(WAIT_COLOR_MS);
+            delay_ms(config.wait_color_ms);
             next_gradient();
         }
 
-        _delay_ms(WAIT_GRADIENT_MS);
+        delay_ms(config.wait_gradient_ms);
     }
 }
 